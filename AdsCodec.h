@@ -0,0 +1,105 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef ASLADSCODEC_H
+#define ASLADSCODEC_H
+
+#include <asl/defs.h>
+#include <string.h>
+
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define ADS_BIG_ENDIAN_HOST
+#endif
+
+/**
+ * Bulk conversion of arrays of numeric values between ADS wire format (little endian) and native values. On little
+ * endian hosts this is a plain memcpy; otherwise bytes are swapped in a simple loop the compiler can vectorize.
+ */
+struct AdsCodec
+{
+	/**
+	 * Decodes `n` values of type T from ADS data at `src` into `dst`
+	 */
+	template<class T>
+	static void decode(const asl::byte* src, int n, T* dst)
+	{
+		convert(src, n * (int)sizeof(T), (int)sizeof(T), (asl::byte*)dst);
+	}
+
+	/**
+	 * Encodes `n` values of type T from `src` into ADS data at `dst`
+	 */
+	template<class T>
+	static void encode(const T* src, int n, asl::byte* dst)
+	{
+		convert((const asl::byte*)src, n * (int)sizeof(T), (int)sizeof(T), dst);
+	}
+
+	static void decode(const asl::byte* src, int n, bool* dst)
+	{
+		for (int i = 0; i < n; i++)
+			dst[i] = src[i] != 0;
+	}
+
+	static void encode(const bool* src, int n, asl::byte* dst)
+	{
+		for (int i = 0; i < n; i++)
+			dst[i] = src[i] ? 1 : 0;
+	}
+
+	/**
+	 * Copies `size` bytes of items of `itemSize` bytes changing byte order if the host is big endian
+	 */
+	static void convert(const asl::byte* src, int size, int itemSize, asl::byte* dst)
+	{
+#ifndef ADS_BIG_ENDIAN_HOST
+		(void)itemSize;
+		memcpy(dst, src, size);
+#else
+		switch (itemSize)
+		{
+		case 2: swap2(src, size / 2, dst); break;
+		case 4: swap4(src, size / 4, dst); break;
+		case 8: swap8(src, size / 8, dst); break;
+		default: memcpy(dst, src, size);
+		}
+#endif
+	}
+
+#ifdef ADS_BIG_ENDIAN_HOST
+	static void swap2(const asl::byte* src, int n, asl::byte* dst)
+	{
+		for (int i = 0; i < n; i++, src += 2, dst += 2)
+		{
+			asl::byte b0 = src[0], b1 = src[1];
+			dst[0] = b1;
+			dst[1] = b0;
+		}
+	}
+
+	static void swap4(const asl::byte* src, int n, asl::byte* dst)
+	{
+		for (int i = 0; i < n; i++, src += 4, dst += 4)
+		{
+			asl::byte b0 = src[0], b1 = src[1], b2 = src[2], b3 = src[3];
+			dst[0] = b3;
+			dst[1] = b2;
+			dst[2] = b1;
+			dst[3] = b0;
+		}
+	}
+
+	static void swap8(const asl::byte* src, int n, asl::byte* dst)
+	{
+		for (int i = 0; i < n; i++, src += 8, dst += 8)
+		{
+			asl::byte b[8];
+			memcpy(b, src, 8);
+			for (int j = 0; j < 8; j++)
+				dst[j] = b[7 - j];
+		}
+	}
+#endif
+};
+
+#endif
@@ -0,0 +1,294 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef ASLADSCOROUTINE_H
+#define ASLADSCOROUTINE_H
+
+#include "BeckhoffAds.h"
+
+/*
+ * C++20 coroutine support: awaitables for the asynchronous operations of BeckhoffAds. Only available when the compiler
+ * supports coroutines (ADS_HAVE_COROUTINES is then defined); otherwise this header declares nothing.
+ *
+ * A coroutine continues in the thread that completed the operation (the receive thread for requests, a dispatch
+ * thread for notifications), so between awaits it must only start asynchronous operations or hand work elsewhere.
+ *
+ * ```
+ * AdsTask sequence(BeckhoffAds& plc)
+ * {
+ *     float speed = co_await adsReadValue<float>(plc, "GVL.speed");
+ *     BeckhoffAds::Handle h = co_await adsGetHandle(plc, "GVL.count");
+ *     co_await adsWriteValue<int>(plc, h, 0);
+ * }
+ * ```
+ */
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define ADS_HAVE_COROUTINES
+#endif
+#endif
+
+#ifdef ADS_HAVE_COROUTINES
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+
+/**
+ * A fire-and-forget coroutine type: it starts running when called and frees itself when it ends
+ */
+struct AdsTask
+{
+	struct promise_type
+	{
+		AdsTask             get_return_object() { return AdsTask(); }
+		std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+		std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+		void                return_void() {}
+		void                unhandled_exception() { std::terminate(); }
+	};
+};
+
+/**
+ * Awaits a request started with a result callback and gives its BeckhoffAds::Result (error -1 if it could not be sent)
+ */
+class AdsResultAwaiter
+{
+public:
+	typedef std::function<bool(const asl::Function<void, const BeckhoffAds::Result&>&)> Start;
+
+	AdsResultAwaiter(const Start& start) : _start(start) {}
+
+	bool await_ready() const { return false; }
+
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		// once started, the awaiter may be resumed (and destroyed) from another thread: do not touch it after that
+		BeckhoffAds::Result* result = &_result;
+		if (_start([result, h](const BeckhoffAds::Result& r) {
+			    *result = r;
+			    h.resume();
+		    }))
+			return true;
+		_result.error = -1;
+		return false;
+	}
+
+	BeckhoffAds::Result await_resume() { return _result; }
+
+protected:
+	Start               _start;
+	BeckhoffAds::Result _result;
+};
+
+/**
+ * Awaits a read and gives its data as a value of type T (T() on error)
+ */
+template<class T>
+class AdsValueAwaiter : public AdsResultAwaiter
+{
+public:
+	AdsValueAwaiter(const Start& start) : AdsResultAwaiter(start) {}
+
+	T await_resume()
+	{
+		T value = T();
+		if (!!_result && _result.data.length() == sizeof(T))
+			AdsCodec::decode(_result.data.ptr(), 1, &value);
+		return value;
+	}
+};
+
+/**
+ * Awaits getting a variable handle (invalid on error)
+ */
+class AdsHandleAwaiter
+{
+public:
+	AdsHandleAwaiter(BeckhoffAds& plc, const asl::String& name) : _plc(&plc), _name(name) {}
+
+	bool await_ready() const { return false; }
+
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		BeckhoffAds::Handle* handle = &_handle;
+		return _plc->getHandleAsync(_name, [handle, h](BeckhoffAds::Handle r) {
+			*handle = r;
+			h.resume();
+		});
+	}
+
+	BeckhoffAds::Handle await_resume() { return _handle; }
+
+protected:
+	BeckhoffAds*        _plc;
+	asl::String         _name;
+	BeckhoffAds::Handle _handle;
+};
+
+inline AdsResultAwaiter adsRead(BeckhoffAds& plc, unsigned group, unsigned offset, int length)
+{
+	return AdsResultAwaiter([&plc, group, offset, length](const asl::Function<void, const BeckhoffAds::Result&>& f) {
+		return plc.readAsync(group, offset, length, f);
+	});
+}
+
+inline AdsResultAwaiter adsWrite(BeckhoffAds& plc, unsigned group, unsigned offset, const asl::ByteArray& data)
+{
+	return AdsResultAwaiter([&plc, group, offset, data](const asl::Function<void, const BeckhoffAds::Result&>& f) {
+		return plc.writeAsync(group, offset, data, f);
+	});
+}
+
+inline AdsResultAwaiter adsReadWrite(BeckhoffAds& plc, unsigned group, unsigned offset, int length,
+                                     const asl::ByteArray& data)
+{
+	return AdsResultAwaiter(
+	    [&plc, group, offset, length, data](const asl::Function<void, const BeckhoffAds::Result&>& f) {
+		    return plc.readWriteAsync(group, offset, length, data, f);
+	    });
+}
+
+inline AdsHandleAwaiter adsGetHandle(BeckhoffAds& plc, const asl::String& name)
+{
+	return AdsHandleAwaiter(plc, name);
+}
+
+/**
+ * Reads a variable (by name or handle) as a specific type
+ */
+template<class T, class ID>
+AdsValueAwaiter<T> adsReadValue(BeckhoffAds& plc, const ID& id)
+{
+	return AdsValueAwaiter<T>([&plc, id](const asl::Function<void, const BeckhoffAds::Result&>& f) {
+		return plc.readValueAsync(id, sizeof(T), f);
+	});
+}
+
+/**
+ * Writes a variable by handle as a specific type
+ */
+template<class T>
+AdsResultAwaiter adsWriteValue(BeckhoffAds& plc, const BeckhoffAds::Handle& handle, const T& value)
+{
+	asl::ByteArray data(sizeof(T));
+	AdsCodec::encode(&value, 1, data.ptr());
+	return AdsResultAwaiter([&plc, handle, data](const asl::Function<void, const BeckhoffAds::Result&>& f) {
+		return plc.writeValueAsync(handle, data, f);
+	});
+}
+
+/**
+ * A notification whose samples can be awaited one by one with `co_await stream.next()`. Samples are queued (up to
+ * `depth`, dropping the oldest) while no coroutine is waiting. Only one coroutine should await at a time.
+ */
+class AdsNotificationStream
+{
+public:
+	/**
+	 * A received sample: PLC timestamp and a copy of the data
+	 */
+	struct Item
+	{
+		double         time;
+		asl::ByteArray data;
+
+		template<class T>
+		T value() const
+		{
+			T value = T();
+			if (data.length() == sizeof(T))
+				AdsCodec::decode(data.ptr(), 1, &value);
+			return value;
+		}
+	};
+
+	class Next
+	{
+	public:
+		Next(AdsNotificationStream* s) : _stream(s) {}
+		bool await_ready() const { return false; }
+		bool await_suspend(std::coroutine_handle<> h) { return _stream->wait(h); }
+		Item await_resume() { return _stream->pop(); }
+
+	protected:
+		AdsNotificationStream* _stream;
+	};
+
+	AdsNotificationStream(BeckhoffAds& plc, const asl::String& name, int length,
+	                      BeckhoffAds::NotificationMode mode = BeckhoffAds::NOTIF_CHANGE, double maxt = 0.01,
+	                      double cycle = 0.01, int depth = 64)
+	    : _plc(&plc), _depth(asl::max(depth, 1))
+	{
+		_handle = plc.addBatchNotification(name, length, mode, maxt, cycle,
+		                                   [this](const asl::Array<BeckhoffAds::Sample>& samples) { push(samples); });
+	}
+
+	~AdsNotificationStream()
+	{
+		if (!!_handle)
+			_plc->removeNotification(_handle);
+	}
+
+	/**
+	 * Returns the notification handle (invalid if the notification could not be added)
+	 */
+	const BeckhoffAds::Handle& handle() const { return _handle; }
+
+	/**
+	 * Returns an awaitable that gives the next sample
+	 */
+	Next next() { return Next(this); }
+
+protected:
+	AdsNotificationStream(const AdsNotificationStream&);
+	void operator=(const AdsNotificationStream&);
+
+	void push(const asl::Array<BeckhoffAds::Sample>& samples)
+	{
+		std::coroutine_handle<> waiter;
+		{
+			asl::Lock _(_mutex);
+			foreach (const BeckhoffAds::Sample& sample, samples)
+			{
+				if (_queue.length() == _depth)
+					_queue.remove(0);
+				Item item = { sample.time, sample.bytes() };
+				_queue << item;
+			}
+			waiter = _waiter;
+			_waiter = std::coroutine_handle<>();
+		}
+		if (waiter)
+			waiter.resume();
+	}
+
+	bool wait(std::coroutine_handle<> h)
+	{
+		asl::Lock _(_mutex);
+		if (_queue.length() > 0)
+			return false;
+		_waiter = h;
+		return true;
+	}
+
+	Item pop()
+	{
+		asl::Lock _(_mutex);
+		Item item = _queue[0];
+		_queue.remove(0);
+		return item;
+	}
+
+	BeckhoffAds*            _plc;
+	BeckhoffAds::Handle     _handle;
+	asl::Mutex              _mutex;
+	asl::Array<Item>        _queue;
+	std::coroutine_handle<> _waiter;
+	int                     _depth;
+};
+
+#endif
+
+#endif
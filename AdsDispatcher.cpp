@@ -0,0 +1,269 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#include "AdsDispatcher.h"
+#include <asl/Thread.h>
+#include <asl/time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+using namespace asl;
+
+struct AdsDispatchWorker : public asl::Thread
+{
+	AdsDispatcher* _dispatcher;
+
+	void run() { _dispatcher->work(); }
+};
+
+ULong adsThreadId()
+{
+#ifdef _WIN32
+	return GetCurrentThreadId();
+#else
+	return (ULong)pthread_self();
+#endif
+}
+
+AdsDispatcher::AdsDispatcher(int threads, int depth, Overflow policy)
+{
+	_threads = max(threads, 0);
+	_depth = max(depth, 1);
+	_policy = policy;
+	_stop = false;
+	_dropped = 0;
+}
+
+AdsDispatcher::~AdsDispatcher()
+{
+	stop();
+}
+
+void AdsDispatcher::start()
+{
+	for (int i = 0; i < _threads; i++)
+	{
+		AdsDispatchWorker* worker = new AdsDispatchWorker;
+		worker->_dispatcher = this;
+		worker->start();
+		_workers << worker;
+	}
+}
+
+void AdsDispatcher::stop()
+{
+	{
+		Lock _(_mutex);
+		if (_stop)
+			return;
+		_stop = true;
+		foreach (Queue* q, _queues) // unblock producers waiting for space
+		{
+			for (int i = 0; i < q->waiting; i++)
+				q->space.post();
+		}
+	}
+
+	for (int i = 0; i < _workers.length(); i++)
+		_ready.post();
+
+	foreach (AdsDispatchWorker* worker, _workers)
+	{
+		worker->join();
+		delete worker;
+	}
+	_workers.clear();
+
+	// free all queues, including removed ones still scheduled; those with producers woken above but not yet returned
+	// are deleted by the last of them
+
+	Lock          _(_mutex);
+	Array<Queue*> queues;
+	foreach (Queue* q, _queues)
+		queues << q;
+	foreach (Queue* q, _readyList)
+		if (q->removed)
+			queues << q;
+	foreach (Queue* q, queues)
+	{
+		q->removed = true;
+		q->scheduled = false;
+		if (unused(q))
+			delete q;
+	}
+	_queues.clear();
+	_readyList.clear();
+}
+
+void AdsDispatcher::post(ULong key, const Callback& f, const Batch& batch)
+{
+	if (_threads == 0)
+	{
+		// count callbacks running inline so that remove() can wait for them
+		{
+			Lock    _(_mutex);
+			Inline& running = _inline[key];
+			running.count++;
+			running.thread = adsThreadId();
+		}
+		f(batch.samples);
+		Lock _(_mutex);
+		if (--_inline[key].count == 0)
+			_inline.remove(key);
+		_idle.broadcast();
+		return;
+	}
+
+	double posted = now();
+
+	Lock _(_mutex);
+
+	if (_stop)
+		return;
+
+	if (_workers.length() == 0)
+		start();
+
+	Queue* q = _queues.has(key) ? _queues[key] : 0;
+	if (!q)
+	{
+		q = new Queue;
+		q->f = f;
+		q->items.resize(_depth);
+		q->head = q->count = 0;
+		q->scheduled = q->removed = q->running = false;
+		q->runner = 0;
+		q->waiting = q->flushing = 0;
+		_queues[key] = q;
+	}
+
+	while (q->count == _depth && _policy == BLOCK && !_stop && !q->removed)
+	{
+		q->waiting++;
+		_mutex.unlock();
+		q->space.wait();
+		_mutex.lock();
+		q->waiting--;
+	}
+
+	if (_stop || q->removed)
+	{
+		if (unused(q))
+			delete q;
+		return;
+	}
+
+	if (q->count == _depth)
+	{
+		_dropped++;
+		if (_policy == COALESCE)
+		{
+			Batch& last = q->items[(q->head + q->count - 1) % _depth];
+			last = batch;
+			last.posted = posted;
+			return;
+		}
+		q->head = (q->head + 1) % _depth;
+		q->count--;
+	}
+
+	Batch& item = q->items[(q->head + q->count) % _depth];
+	item = batch;
+	item.posted = posted;
+	q->count++;
+
+	if (!q->scheduled)
+	{
+		q->scheduled = true;
+		_readyList << q;
+		_ready.post();
+	}
+}
+
+void AdsDispatcher::remove(ULong key, bool wait)
+{
+	Lock _(_mutex);
+	if (_threads == 0)
+	{
+		while (wait && _inline.has(key) && _inline[key].thread != adsThreadId())
+			_idle.wait(_mutex);
+		return;
+	}
+	if (!_queues.has(key))
+		return;
+	Queue* q = _queues[key];
+	_queues.remove(key);
+	q->removed = true;
+	q->count = 0;
+	for (int i = 0; i < q->waiting; i++)
+		q->space.post();
+	if (wait && q->running && q->runner != adsThreadId())
+	{
+		q->flushing++;
+		while (q->running)
+			_idle.wait(_mutex);
+		q->flushing--;
+	}
+	if (unused(q))
+		delete q;
+}
+
+void AdsDispatcher::release(Queue* q)
+{
+	q->scheduled = false;
+	if (unused(q))
+		delete q;
+}
+
+void AdsDispatcher::work()
+{
+	while (1)
+	{
+		_ready.wait();
+
+		Queue* q = 0;
+		Batch  batch;
+		{
+			Lock _(_mutex);
+			if (_stop)
+				break;
+			if (_readyList.length() == 0)
+				continue;
+			q = _readyList[0];
+			_readyList.remove(0);
+			if (q->count == 0)
+			{
+				release(q);
+				continue;
+			}
+			batch = q->items[q->head];
+			q->items[q->head] = Batch();
+			q->head = (q->head + 1) % _depth;
+			q->count--;
+			q->running = true;
+			q->runner = adsThreadId();
+			if (q->waiting > 0)
+				q->space.post();
+		}
+
+		// only one worker has this queue at a time, so its callbacks run in order
+
+		_delay.add(now() - batch.posted);
+		q->f(batch.samples);
+
+		Lock _(_mutex);
+		q->running = false;
+		if (q->flushing > 0)
+			_idle.broadcast();
+		if (q->count > 0 && !q->removed && !_stop)
+		{
+			_readyList << q;
+			_ready.post();
+		}
+		else
+			release(q);
+	}
+}
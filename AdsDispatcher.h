@@ -0,0 +1,159 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef ASLADSDISPATCHER_H
+#define ASLADSDISPATCHER_H
+
+#include <asl/Mutex.h>
+#include <asl/Map.h>
+#include <asl/util.h>
+#include <asl/StreamBuffer.h>
+#include "AdsMetrics.h"
+
+struct AdsDispatchWorker;
+
+/**
+ * Returns an identifier of the calling thread
+ */
+asl::ULong adsThreadId();
+
+/**
+ * A notification sample: PLC timestamp (seconds since 1970 UTC, as in asl::Date), notification handle and a view of
+ * the data, which is valid during the callback
+ */
+struct AdsSample
+{
+	double           time;
+	unsigned         handle;
+	const asl::byte* data;
+	int              size;
+
+	/**
+	 * Returns the data as a value of a specific type
+	 */
+	template<class T>
+	T value() const
+	{
+		return size < (int)sizeof(T) ? T() : asl::StreamBufferReader(data, size).read<T>();
+	}
+	/**
+	 * Returns a copy of the data
+	 */
+	asl::ByteArray bytes() const { return asl::ByteArray(data, size); }
+};
+
+/**
+ * Runs notification callbacks on a fixed pool of worker threads. Batches of samples (those of one handle in one
+ * received frame) are queued per key (the notification handle combined with a connection id, so a dispatcher can be
+ * shared by several connections), so callbacks of one handle run in order and never concurrently, while different
+ * handles run in parallel.
+ */
+class AdsDispatcher
+{
+	friend AdsDispatchWorker;
+
+public:
+	/**
+	 * What to do when a new batch arrives and the handle's queue is full
+	 */
+	enum Overflow
+	{
+		DROP_OLDEST, // discard the oldest pending batch
+		COALESCE,    // replace the newest pending batch with the new one
+		BLOCK        // wait for space (stalls the receiving connection)
+	};
+
+	typedef asl::Function<void, const asl::Array<AdsSample>&> Callback;
+
+	/**
+	 * Samples of one handle and the received frame their data points into, and when it was queued
+	 */
+	struct Batch
+	{
+		asl::ByteArray        frame;
+		asl::Array<AdsSample> samples;
+		double                posted;
+		Batch() : posted(0) {}
+	};
+
+	/**
+	 * Creates a dispatcher with a number of worker threads (0 to call callbacks from the posting thread), a maximum
+	 * number of pending batches per handle and an overflow policy
+	 */
+	AdsDispatcher(int threads = 2, int depth = 64, Overflow policy = DROP_OLDEST);
+	~AdsDispatcher();
+
+	/**
+	 * Queues a batch for the given key; `f` is used as the key's callback if it has no queue yet
+	 */
+	void post(asl::ULong key, const Callback& f, const Batch& batch);
+
+	/**
+	 * Discards the pending batches and the callback of a key; with `wait` it returns once a callback of that key that
+	 * is already running has finished (unless called from that callback), so its captured state can be destroyed
+	 */
+	void remove(asl::ULong key, bool wait = true);
+
+	/**
+	 * Stops the worker threads, discarding pending batches
+	 */
+	void stop();
+
+	/**
+	 * Returns the number of batches discarded or coalesced because of full queues
+	 */
+	int dropped() const { return _dropped; }
+
+	/**
+	 * Returns the histogram of times batches wait in their queue before their callback starts
+	 */
+	const AdsHistogram& delay() const { return _delay; }
+
+protected:
+	/**
+	 * Callbacks of a key running in posting threads (with no worker threads) and the last thread running one
+	 */
+	struct Inline
+	{
+		int        count;
+		asl::ULong thread;
+		Inline() : count(0), thread(0) {}
+	};
+
+	struct Queue
+	{
+		Callback          f;
+		asl::Array<Batch> items;
+		int               head;
+		int               count;
+		bool              scheduled;
+		bool              removed;
+		bool              running;
+		asl::ULong        runner; // thread running the callback
+		int               waiting;
+		int               flushing;
+		asl::Semaphore    space;
+	};
+
+	void start();
+	void work();
+	void release(Queue* q);
+	bool unused(Queue* q) const { return q->removed && !q->scheduled && q->waiting == 0 && q->flushing == 0; }
+
+protected:
+	asl::Mutex                     _mutex;
+	asl::Semaphore                 _ready;
+	asl::Condition                 _idle;
+	asl::Array<Queue*>             _readyList;
+	asl::Map<asl::ULong, Queue*>   _queues;
+	asl::Map<asl::ULong, Inline>   _inline;
+	asl::Array<AdsDispatchWorker*> _workers;
+	int                            _threads;
+	int                            _depth;
+	Overflow                       _policy;
+	bool                           _stop;
+	int                            _dropped;
+	AdsHistogram                   _delay;
+};
+
+#endif
@@ -0,0 +1,190 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#include "AdsLayout.h"
+
+using namespace asl;
+
+// limits against recursive types and huge arrays of structs
+
+const int LAYOUT_MAX_DEPTH = 16;
+const int LAYOUT_MAX_FIELDS = 100000;
+
+template<class T>
+inline double decodeAs(const byte* p)
+{
+	T x;
+	AdsCodec::decode(p, 1, &x);
+	return (double)x;
+}
+
+// byte size of the values of a primitive type code, 0 for others (which decode as 0)
+
+static int primitiveSize(int typecode)
+{
+	switch (typecode)
+	{
+	case BeckhoffAds::ADST_BIT:
+	case BeckhoffAds::ADST_INT8:
+	case BeckhoffAds::ADST_UINT8: return 1;
+	case BeckhoffAds::ADST_INT16:
+	case BeckhoffAds::ADST_UINT16: return 2;
+	case BeckhoffAds::ADST_INT32:
+	case BeckhoffAds::ADST_UINT32:
+	case BeckhoffAds::ADST_REAL32: return 4;
+	case BeckhoffAds::ADST_INT64:
+	case BeckhoffAds::ADST_UINT64:
+	case BeckhoffAds::ADST_REAL64: return 8;
+	}
+	return 0;
+}
+
+// index suffix of element `i` of an array, with all its dimensions ("[2,0]"), the last one varying fastest
+
+static String elementIndex(const Array<BeckhoffAds::ArrayDim>& dims, int i)
+{
+	String index = "]";
+	for (int d = dims.length() - 1; d >= 0; d--)
+	{
+		index = String::f("%s%i", d > 0 ? "," : "[", dims[d].lower + i % dims[d].elements) + index;
+		i /= dims[d].elements;
+	}
+	return index;
+}
+
+// name of the element type of an array member ("ARRAY [0..9] OF ST_Axis" -> "ST_Axis")
+
+static String elementType(const BeckhoffAds::DataType& field)
+{
+	if (field.dims.length() == 0)
+		return field.type;
+	int i = field.type.indexOf(" OF ");
+	return i < 0 ? field.type : field.type.substring(i + 4).trimmed();
+}
+
+bool AdsLayout::compile(const Array<DataType>& types, const String& typeName)
+{
+	Map<String, const DataType*> index;
+	foreach (const DataType& type, types)
+		index[type.name.toLowerCase()] = &type;
+
+	_fields.clear();
+	_names.clear();
+	_size = 0;
+	_count = 0;
+
+	String key = typeName.toLowerCase();
+	if (!index.has(key))
+	{
+		ADS_LOG(ERROR, "data type %s not found", *typeName);
+		return false;
+	}
+	const DataType& type = *index[key];
+	_size = type.size;
+	if (type.fields.length() == 0)
+		addField("", 0, type.size, 1, type.typecode);
+	else
+		flatten(index, type, "", 0, 0);
+	return true;
+}
+
+void AdsLayout::addField(const String& name, unsigned offset, int size, int count, int typecode)
+{
+	// a type table inconsistent with the type size (stale or corrupt) must not make decode() read out of bounds
+
+	if (size < primitiveSize(typecode) || (Long)offset + (Long)size * count > _size)
+	{
+		ADS_LOG(ERROR, "layout field %s out of bounds (offset %u, %i x %i bytes)", *name, offset, count, size);
+		return;
+	}
+	Field field = { name, offset, size, count, typecode, _count };
+	_names[name.toLowerCase()] = _fields.length();
+	_fields << field;
+	_count += count;
+}
+
+void AdsLayout::flatten(const Map<String, const DataType*>& types, const DataType& type, const String& prefix,
+                        unsigned base, int depth)
+{
+	foreach (const DataType& field, type.fields)
+	{
+		if (_fields.length() >= LAYOUT_MAX_FIELDS)
+			return;
+
+		String name = prefix + field.name;
+		int    count = 1;
+		foreach (const BeckhoffAds::ArrayDim& dim, field.dims)
+			count *= max(dim.elements, 0);
+		if (count <= 0)
+			continue;
+
+		if (field.size < 0 || (Long)base + field.offset + field.size > _size)
+		{
+			ADS_LOG(ERROR, "layout field %s out of bounds (offset %u, %i bytes)", *name, base + field.offset, field.size);
+			continue;
+		}
+
+		String          elemName = elementType(field).toLowerCase();
+		const DataType* elem = types.has(elemName) ? types[elemName] : 0;
+
+		if (!elem || elem->fields.length() == 0 || depth >= LAYOUT_MAX_DEPTH)
+		{
+			addField(name, base + field.offset, field.size / count, count, field.typecode);
+			continue;
+		}
+
+		if (field.dims.length() == 0)
+		{
+			flatten(types, *elem, name + ".", base + field.offset, depth + 1);
+			continue;
+		}
+
+		// arrays of structs are expanded per element, named with the indices of all dimensions
+
+		int elemSize = field.size / count;
+		for (int i = 0; i < count; i++)
+			flatten(types, *elem, name + elementIndex(field.dims, i) + ".", base + field.offset + i * elemSize, depth + 1);
+	}
+}
+
+const AdsLayout::Field* AdsLayout::field(const String& name) const
+{
+	int i = _names.get(name.toLowerCase(), -1);
+	return i < 0 ? 0 : &_fields[i];
+}
+
+bool AdsLayout::decode(const ByteArray& data, Array<double>& values) const
+{
+	if (data.length() < _size)
+		return false;
+
+	values.resize(_count);
+	double* v = values.ptr();
+
+	for (int i = 0; i < _fields.length(); i++)
+	{
+		const Field& f = _fields[i];
+		const byte*  p = data.ptr() + f.offset;
+		for (int j = 0; j < f.count; j++, p += f.size)
+		{
+			double x = 0;
+			switch (f.typecode)
+			{
+			case BeckhoffAds::ADST_BIT: x = *p != 0; break;
+			case BeckhoffAds::ADST_INT8: x = (signed char)*p; break;
+			case BeckhoffAds::ADST_UINT8: x = *p; break;
+			case BeckhoffAds::ADST_INT16: x = decodeAs<short>(p); break;
+			case BeckhoffAds::ADST_UINT16: x = decodeAs<unsigned short>(p); break;
+			case BeckhoffAds::ADST_INT32: x = decodeAs<int>(p); break;
+			case BeckhoffAds::ADST_UINT32: x = decodeAs<unsigned>(p); break;
+			case BeckhoffAds::ADST_INT64: x = (double)decodeAs<Long>(p); break;
+			case BeckhoffAds::ADST_UINT64: x = (double)decodeAs<ULong>(p); break;
+			case BeckhoffAds::ADST_REAL32: x = decodeAs<float>(p); break;
+			case BeckhoffAds::ADST_REAL64: x = decodeAs<double>(p); break;
+			default:;
+			}
+			*v++ = x;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,171 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef ASLADSLAYOUT_H
+#define ASLADSLAYOUT_H
+
+#include "BeckhoffAds.h"
+
+/**
+ * The flattened memory layout of a PLC struct type, compiled once from the data type table (`getDataTypes()`): one
+ * field per primitive member, with nested structs and arrays of structs expanded into paths like `axes[2].pos` (or
+ * `grid[1,2].pos` for several dimensions). Members that do not fit in the type's size are left out. A struct read as
+ * a whole can then be decoded in a single pass without name lookups.
+ *
+ * ```
+ * AdsLayout layout;
+ * layout.compile(plc.getDataTypes(), "ST_Machine");
+ * asl::Array<double> values;
+ * layout.decode(plc.readValue("GVL.machine", layout.size(), true), values);
+ * ```
+ */
+class AdsLayout
+{
+public:
+	typedef BeckhoffAds::DataType DataType;
+
+	struct Field
+	{
+		asl::String name;     // member path
+		unsigned    offset;   // byte offset in the struct
+		int         size;     // size of one element
+		int         count;    // number of elements (1 if not an array)
+		int         typecode; // ADST_* code of the elements
+		int         index;    // index of the first element in the decoded value vector
+	};
+
+	AdsLayout() : _size(0), _count(0) {}
+
+	/**
+	 * Compiles the layout of the type with the given name, returns false if the type is not in the table
+	 */
+	bool compile(const asl::Array<DataType>& types, const asl::String& typeName);
+
+	/**
+	 * Returns the byte size of the struct
+	 */
+	int size() const { return _size; }
+
+	/**
+	 * Returns the primitive fields in memory order
+	 */
+	const asl::Array<Field>& fields() const { return _fields; }
+
+	/**
+	 * Returns the field with the given path, or null (for setup, not for each read)
+	 */
+	const Field* field(const asl::String& name) const;
+
+	/**
+	 * Returns the number of values `decode()` produces
+	 */
+	int valueCount() const { return _count; }
+
+	/**
+	 * Decodes the struct data into a flat vector with one value per element of each field (non-numeric fields,
+	 * like strings, give 0), returns false if the data is too short
+	 */
+	bool decode(const asl::ByteArray& data, asl::Array<double>& values) const;
+
+protected:
+	void flatten(const asl::Map<asl::String, const DataType*>& types, const DataType& type, const asl::String& prefix,
+	             unsigned base, int depth);
+	void addField(const asl::String& name, unsigned offset, int size, int count, int typecode);
+
+	asl::Array<Field>          _fields;
+	asl::Map<asl::String, int> _names;
+	int                        _size;
+	int                        _count;
+};
+
+/**
+ * Binds fields of a compiled layout to members of a C++ struct, so that struct data read from the PLC is copied into
+ * (or written from) the C++ struct with a precomputed list of copies.
+ *
+ * ```
+ * struct Axis { float pos; float speed; short state; };
+ * AdsStructBinding<Axis> binding(layout);
+ * binding.bind("pos", &Axis::pos).bind("speed", &Axis::speed).bind("state", &Axis::state);
+ * Axis axis;
+ * binding.read(plc, "GVL.axis1", axis);
+ * ```
+ */
+template<class S>
+class AdsStructBinding
+{
+public:
+	AdsStructBinding(const AdsLayout& layout) : _layout(&layout), _ok(true) {}
+
+	/**
+	 * Binds a layout field (a primitive or an array of primitives) to a member of the same byte size
+	 */
+	template<class M>
+	AdsStructBinding& bind(const asl::String& name, M S::*member)
+	{
+		const AdsLayout::Field* f = _layout->field(name);
+		if (!f || f->size * f->count != (int)sizeof(M))
+		{
+			ADS_LOG(ERROR, "cannot bind field '%s'", *name);
+			_ok = false;
+			return *this;
+		}
+		S    probe;
+		Copy copy = { (int)f->offset, int((asl::byte*)&(probe.*member) - (asl::byte*)&probe), (int)sizeof(M), f->size };
+		_copies << copy;
+		return *this;
+	}
+
+	/**
+	 * Returns true if all fields were bound
+	 */
+	bool ok() const { return _ok; }
+
+	/**
+	 * Copies the bound fields from struct data to a C++ struct
+	 */
+	bool decode(const asl::ByteArray& data, S& s) const
+	{
+		if (data.length() < _layout->size())
+			return false;
+		for (int i = 0; i < _copies.length(); i++)
+		{
+			const Copy& c = _copies[i];
+			AdsCodec::convert(data.ptr() + c.src, c.size, c.itemSize, (asl::byte*)&s + c.dst);
+		}
+		return true;
+	}
+
+	/**
+	 * Copies the bound fields from a C++ struct into struct data (other bytes are left as they are)
+	 */
+	void encode(const S& s, asl::ByteArray& data) const
+	{
+		if (data.length() < _layout->size())
+			data.resize(_layout->size());
+		for (int i = 0; i < _copies.length(); i++)
+		{
+			const Copy& c = _copies[i];
+			AdsCodec::convert((const asl::byte*)&s + c.dst, c.size, c.itemSize, data.ptr() + c.src);
+		}
+	}
+
+	/**
+	 * Reads a struct variable (by name, handle or symbol) into a C++ struct
+	 */
+	template<class ID>
+	bool read(BeckhoffAds& plc, const ID& id, S& s) const
+	{
+		return decode(plc.readValue(id, _layout->size(), true), s);
+	}
+
+protected:
+	struct Copy
+	{
+		int src, dst, size, itemSize;
+	};
+	const AdsLayout* _layout;
+	asl::Array<Copy> _copies;
+	bool             _ok;
+};
+
+#endif
@@ -0,0 +1,225 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#include "AdsLog.h"
+#include <asl/Thread.h>
+#include <asl/time.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+using namespace asl;
+
+enum
+{
+	MESSAGE_SIZE = 256,
+	RING_SIZE = 256 // power of 2
+};
+
+struct AdsConsoleLog : public AdsLogSink
+{
+	void write(int, const char* message) { printf("ADS: %s\n", message); }
+};
+
+/**
+ * A slot of the ring buffer: `claim` is taken by the producer that writes the slot, `ready` is set when the message
+ * is complete; the consumer clears both. `skip` counts tickets of this slot whose message was dropped because the
+ * ring was full, so the consumer passes over them without waiting
+ */
+struct AdsLogSlot
+{
+	AtomicCount claim;
+	AtomicCount ready;
+	AtomicCount skip;
+	int         level;
+	char        text[MESSAGE_SIZE];
+};
+
+struct AdsLogThread : public Thread
+{
+	void run();
+};
+
+volatile int AdsLog::_level = AdsLog::LEVEL_INFO;
+
+static AdsConsoleLog console;
+static AdsLogSink*   sink = &console;
+static Mutex         sinkMutex;
+static Mutex         siteMutex;
+static Mutex         threadMutex;
+static Semaphore     wakeup;
+static AdsLogSlot    ring[RING_SIZE];
+static AtomicCount   head;
+static volatile int  tail = 0;
+static AtomicCount   droppedCount;
+static AdsLogThread* thread = 0;
+static volatile bool stopping = false;
+static volatile bool async = true;
+static int           burst = 10;
+static double        period = 1.0;
+static double        startTime = now();
+
+// writes pending messages, called only from the logging thread (or after it stopped)
+
+static void drain()
+{
+	while (tail != head)
+	{
+		AdsLogSlot& slot = ring[tail & (RING_SIZE - 1)];
+		if (!slot.ready)
+		{
+			// the message was dropped, or a producer took the ticket and is still writing it
+
+			if (slot.skip > 0)
+			{
+				--slot.skip;
+				tail++;
+			}
+			else
+				sleep(0.0001);
+			continue;
+		}
+		{
+			Lock _(sinkMutex);
+			sink->write(slot.level, slot.text);
+		}
+		--slot.ready;
+		--slot.claim;
+		tail++;
+	}
+}
+
+void AdsLogThread::run()
+{
+	while (!stopping)
+	{
+		wakeup.wait();
+		drain();
+	}
+}
+
+// stops the logging thread at exit, writing pending messages
+
+static struct AdsLogShutdown
+{
+	~AdsLogShutdown()
+	{
+		Lock _(threadMutex);
+		if (!thread)
+			return;
+		stopping = true;
+		wakeup.post();
+		thread->join();
+		delete thread;
+		thread = 0;
+		drain();
+	}
+} logShutdown;
+
+static void startThread()
+{
+	Lock _(threadMutex);
+	if (thread || stopping)
+		return;
+	thread = new AdsLogThread;
+	thread->start();
+}
+
+static void format(char* text, int suppressed, const char* fmt, va_list args)
+{
+	int n = vsnprintf(text, MESSAGE_SIZE, fmt, args);
+	if (suppressed > 0 && n >= 0 && n < MESSAGE_SIZE)
+		snprintf(text + n, MESSAGE_SIZE - n, " (%i similar messages suppressed)", suppressed);
+}
+
+// decides if a message of a site is written, and returns the messages suppressed in its previous period
+
+static bool allow(AdsLogSite& site, int& suppressed)
+{
+	if (burst <= 0)
+		return true;
+	int window = int((now() - startTime) / period);
+	if (window != site.window)
+	{
+		Lock _(siteMutex);
+		if (window != site.window)
+		{
+			suppressed = max(site.count - burst, 0);
+			site.count -= site.count;
+			site.window = window;
+		}
+	}
+	return ++site.count <= burst;
+}
+
+void AdsLog::write(AdsLogSite& site, int level, const char* fmt, ...)
+{
+	int suppressed = 0;
+	if (!allow(site, suppressed))
+		return;
+
+	va_list args;
+	va_start(args, fmt);
+
+	if (!async)
+	{
+		char text[MESSAGE_SIZE];
+		format(text, suppressed, fmt, args);
+		va_end(args);
+		Lock _(sinkMutex);
+		sink->write(level, text);
+		return;
+	}
+
+	if (!thread)
+		startThread();
+
+	// take a ticket, then its slot; if the slot still holds an unwritten message the ring is full and the ticket is
+	// marked as skipped before releasing the claim
+
+	int         i = ++head - 1;
+	AdsLogSlot& slot = ring[i & (RING_SIZE - 1)];
+	if (++slot.claim != 1)
+	{
+		++slot.skip;
+		--slot.claim;
+		++droppedCount;
+		wakeup.post();
+		va_end(args);
+		return;
+	}
+	slot.level = level;
+	format(slot.text, suppressed, fmt, args);
+	va_end(args);
+	++slot.ready;
+	wakeup.post();
+}
+
+void AdsLog::setSink(AdsLogSink* s)
+{
+	Lock _(sinkMutex);
+	sink = s ? s : &console;
+}
+
+void AdsLog::setRateLimit(int n, double t)
+{
+	burst = n;
+	period = t > 0 ? t : 1.0;
+}
+
+void AdsLog::setAsync(bool on)
+{
+	if (!on)
+		flush();
+	async = on;
+}
+
+void AdsLog::flush()
+{
+	while (thread && !stopping && tail != head)
+		sleep(0.001);
+}
+
+int AdsLog::dropped()
+{
+	return droppedCount;
+}
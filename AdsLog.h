@@ -0,0 +1,113 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef ASLADSLOG_H
+#define ASLADSLOG_H
+
+#include <asl/atomic.h>
+
+// levels below this are removed at compile time (0: debug, 1: info, 2: warning, 3: error, 4: none)
+
+#ifndef ADS_LOG_MIN_LEVEL
+#define ADS_LOG_MIN_LEVEL 0
+#endif
+
+#ifdef __GNUC__
+#define ADS_LOG_FORMAT __attribute__((format(printf, 3, 4)))
+#else
+#define ADS_LOG_FORMAT
+#endif
+
+/**
+ * Receives log messages (without the "ADS: " prefix or newline). In asynchronous mode `write()` is only called from
+ * the logging thread; the sink must outlive its use.
+ */
+struct AdsLogSink
+{
+	virtual ~AdsLogSink() {}
+	virtual void write(int level, const char* message) = 0;
+};
+
+/**
+ * Rate limiting state of one logging statement
+ */
+struct AdsLogSite
+{
+	volatile int     window;
+	asl::AtomicCount count;
+	AdsLogSite() : window(-1) {}
+};
+
+/**
+ * Library logging. Messages are filtered by level, rate limited per statement (repeated messages of a statement beyond
+ * a burst per period are dropped and counted), and by default formatted into a lock-free ring buffer and written to
+ * the sink (stdout by default) by a background thread, so errors repeated at high rate do not stall the caller.
+ */
+class AdsLog
+{
+public:
+	enum Level
+	{
+		LEVEL_DEBUG,
+		LEVEL_INFO,
+		LEVEL_WARNING,
+		LEVEL_ERROR,
+		LEVEL_OFF
+	};
+
+	/**
+	 * Sets the minimum level of messages written (default LEVEL_INFO)
+	 */
+	static void setLevel(int level) { _level = level; }
+
+	static int level() { return _level; }
+
+	static bool enabled(int level) { return level >= ADS_LOG_MIN_LEVEL && level >= _level; }
+
+	/**
+	 * Sets where messages are written (null for stdout)
+	 */
+	static void setSink(AdsLogSink* sink);
+
+	/**
+	 * Sets the maximum number of messages per statement in each period of seconds (a burst of 0 disables the limit)
+	 */
+	static void setRateLimit(int burst, double period = 1.0);
+
+	/**
+	 * Enables or disables writing messages from a background thread (enabled by default); if disabled, the sink
+	 * is called by the calling thread
+	 */
+	static void setAsync(bool async);
+
+	/**
+	 * Waits until queued messages are written
+	 */
+	static void flush();
+
+	/**
+	 * Returns the number of messages dropped because the ring buffer was full
+	 */
+	static int dropped();
+
+	static void write(AdsLogSite& site, int level, const char* format, ...) ADS_LOG_FORMAT;
+
+protected:
+	static volatile int _level;
+};
+
+/**
+ * Logs a message at a level (DEBUG, INFO, WARNING or ERROR) with printf formatting; arguments are not evaluated if
+ * the level is disabled
+ */
+#define ADS_LOG(level, ...)                                                      \
+	do                                                                           \
+	{                                                                            \
+		if (AdsLog::enabled(AdsLog::LEVEL_##level))                              \
+		{                                                                        \
+			static AdsLogSite adsLogSite_;                                       \
+			AdsLog::write(adsLogSite_, AdsLog::LEVEL_##level, __VA_ARGS__);      \
+		}                                                                        \
+	} while (0)
+
+#endif
@@ -0,0 +1,115 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#include "AdsMetrics.h"
+#include <asl/time.h>
+
+using namespace asl;
+
+int AdsHistogram::bucket(ULong v)
+{
+	if (v < SUB_BUCKETS)
+		return (int)v;
+	if (v > 0xffffffffu)
+		v = 0xffffffffu;
+	int k = 4; // position of the highest bit
+	while ((v >> (k + 1)) != 0)
+		k++;
+	return (k - 3) * SUB_BUCKETS + int((v >> (k - 4)) & (SUB_BUCKETS - 1));
+}
+
+double AdsHistogram::value(int bucket)
+{
+	if (bucket < SUB_BUCKETS)
+		return bucket * 1e-6;
+	int  k = bucket / SUB_BUCKETS + 3;
+	int  sub = bucket % SUB_BUCKETS;
+	ULong width = (ULong)1 << (k - 4);
+	return ((SUB_BUCKETS + sub) * width + width / 2) * 1e-6;
+}
+
+void AdsHistogram::add(double seconds)
+{
+	++_counts[bucket(seconds > 0 ? ULong(seconds * 1e6) : 0)];
+}
+
+AdsHistogram::Snapshot AdsHistogram::snapshot() const
+{
+	Snapshot s;
+	s.counts.resize(BUCKETS);
+	for (int i = 0; i < BUCKETS; i++)
+	{
+		s.counts[i] = _counts[i];
+		s.count += s.counts[i];
+	}
+	return s;
+}
+
+void AdsHistogram::reset()
+{
+	for (int i = 0; i < BUCKETS; i++)
+		_counts[i] -= _counts[i];
+}
+
+double AdsHistogram::Snapshot::percentile(double p) const
+{
+	int target = max(int(p * count + 0.5), 1), n = 0;
+	for (int i = 0; i < counts.length(); i++)
+	{
+		n += counts[i];
+		if (n >= target)
+			return value(i);
+	}
+	return 0;
+}
+
+double AdsHistogram::Snapshot::mean() const
+{
+	double sum = 0;
+	for (int i = 0; i < counts.length(); i++)
+		sum += counts[i] * value(i);
+	return count > 0 ? sum / count : 0;
+}
+
+void AdsMetrics::error(int code)
+{
+	Lock _(_errorMutex);
+	_errors[code] = (_errors.has(code) ? _errors[code] : 0) + 1;
+}
+
+AdsMetrics::Snapshot AdsMetrics::snapshot(const AdsHistogram* dispatchDelay) const
+{
+	Snapshot s;
+	s.time = now();
+	s.framesIn = framesIn;
+	s.framesOut = framesOut;
+	s.bytesIn = bytesIn;
+	s.bytesOut = bytesOut;
+	s.notificationFrames = notificationFrames;
+	s.samples = samples;
+	s.timeouts = timeouts;
+	for (int i = 0; i < COMMANDS; i++)
+	{
+		s.requests << requests[i];
+		s.roundTrip << roundTrip[i].snapshot();
+	}
+	if (dispatchDelay)
+		s.dispatchDelay = dispatchDelay->snapshot();
+	Lock _(_errorMutex);
+	foreach2 (int code, int n, _errors)
+		s.errors[code] = n;
+	return s;
+}
+
+void AdsMetrics::reset()
+{
+	framesIn = framesOut = bytesIn = bytesOut = notificationFrames = samples = 0;
+	timeouts -= timeouts;
+	for (int i = 0; i < COMMANDS; i++)
+	{
+		requests[i] -= requests[i];
+		roundTrip[i].reset();
+	}
+	Lock _(_errorMutex);
+	_errors.clear();
+}
@@ -0,0 +1,120 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef ASLADSMETRICS_H
+#define ASLADSMETRICS_H
+
+#include <asl/atomic.h>
+#include <asl/Mutex.h>
+#include <asl/Map.h>
+
+/**
+ * A histogram of durations with logarithmic buckets of 16 linear sub-buckets each (values are kept within about 6%),
+ * from 1 us to over an hour. Adding a value is a single atomic increment.
+ */
+class AdsHistogram
+{
+public:
+	enum
+	{
+		SUB_BUCKETS = 16,
+		BUCKETS = 29 * SUB_BUCKETS
+	};
+
+	/**
+	 * A copy of the bucket counts at some moment
+	 */
+	struct Snapshot
+	{
+		asl::Array<int> counts;
+		int             count;
+
+		Snapshot() : count(0) {}
+
+		/**
+		 * Returns the value (in seconds) below which a fraction `p` of the values are (e.g. 0.99)
+		 */
+		double percentile(double p) const;
+
+		/**
+		 * Returns the mean value in seconds
+		 */
+		double mean() const;
+	};
+
+	/**
+	 * Adds a duration in seconds
+	 */
+	void add(double seconds);
+
+	Snapshot snapshot() const;
+
+	void reset();
+
+	/**
+	 * Returns the bucket of a value in microseconds, and the representative value in seconds of a bucket
+	 */
+	static int    bucket(asl::ULong us);
+	static double value(int bucket);
+
+protected:
+	asl::AtomicCount _counts[BUCKETS];
+};
+
+/**
+ * Counters and round-trip histograms of a connection. Most are written by a single thread (the receive thread, or
+ * senders holding the connection lock), so they are plain counters; the others are atomic.
+ */
+struct AdsMetrics
+{
+	enum
+	{
+		COMMANDS = 10 // ADS command ids
+	};
+
+	/**
+	 * A copy of the metrics at some moment; rates can be computed from the difference of two snapshots
+	 */
+	struct Snapshot
+	{
+		double                             time;               // when taken (seconds)
+		asl::Long                          framesIn;           // frames received
+		asl::Long                          framesOut;          // frames sent
+		asl::Long                          bytesIn;            // bytes received
+		asl::Long                          bytesOut;           // bytes sent
+		asl::Long                          notificationFrames; // notification frames received
+		asl::Long                          samples;            // notification samples received
+		int                                timeouts;           // requests without response
+		asl::Array<int>                    requests;           // requests sent by command id
+		asl::Array<AdsHistogram::Snapshot> roundTrip;          // round-trip times by command id
+		AdsHistogram::Snapshot             dispatchDelay;      // time notification batches wait for a worker
+		asl::Map<int, int>                 errors;             // ADS error counts by code
+	};
+
+	volatile asl::Long framesIn;
+	volatile asl::Long framesOut;
+	volatile asl::Long bytesIn;
+	volatile asl::Long bytesOut;
+	volatile asl::Long notificationFrames;
+	volatile asl::Long samples;
+	asl::AtomicCount   timeouts;
+	asl::AtomicCount   requests[COMMANDS];
+	AdsHistogram       roundTrip[COMMANDS];
+
+	AdsMetrics() { reset(); }
+
+	/**
+	 * Counts an ADS error code
+	 */
+	void error(int code);
+
+	Snapshot snapshot(const AdsHistogram* dispatchDelay) const;
+
+	void reset();
+
+protected:
+	mutable asl::Mutex _errorMutex;
+	asl::Map<int, int> _errors;
+};
+
+#endif
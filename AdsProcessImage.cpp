@@ -0,0 +1,341 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#include "AdsProcessImage.h"
+#include <asl/Thread.h>
+#include <asl/time.h>
+
+using namespace asl;
+
+struct AdsProcessImageThread : public asl::Thread
+{
+	AdsProcessImage* _image;
+
+	void run() { _image->run(); }
+};
+
+AdsProcessImage::AdsProcessImage(BeckhoffAds& plc)
+{
+	_plc = &plc;
+	_inputSize = 0;
+	_outputSize = 0;
+	_thread = 0;
+	_period = 0.01;
+	_stop = false;
+	_ready = false;
+	_cycles = 0;
+	_overruns = 0;
+	_errors = 0;
+	_lastCycleTime = 0;
+}
+
+AdsProcessImage::~AdsProcessImage()
+{
+	stop();
+}
+
+int AdsProcessImage::addInput(const String& name, int size)
+{
+	if (_thread)
+		return -1;
+	Var var = { name, size, _inputSize };
+	_inputVars << var;
+	_inputSize += size;
+	return var.offset;
+}
+
+int AdsProcessImage::addOutput(const String& name, int size)
+{
+	if (_thread)
+		return -1;
+	Var var = { name, size, _outputSize };
+	_outputVars << var;
+	_outputSize += size;
+	return var.offset;
+}
+
+bool AdsProcessImage::prepare(const Array<Var>& vars, bool inputs, Array<BeckhoffAds::Handle>& handles)
+{
+	Array<String> names;
+	Array<int>    sizes;
+	foreach (const Var& var, vars)
+	{
+		names << var.name;
+		sizes << var.size;
+	}
+
+	Array<BeckhoffAds::Handle> h = _plc->getHandles(names);
+	handles.append(h);
+
+	for (int i = 0; i < h.length(); i++)
+	{
+		if (!h[i])
+		{
+			ADS_LOG(ERROR, "process image variable %s not found", *vars[i].name);
+			return false;
+		}
+	}
+
+	Array<BeckhoffAds::PreparedRequest> requests = inputs ? _plc->prepareSumRead(h, sizes)
+	                                                      : _plc->prepareSumWrite(h, sizes);
+	Array<Chunk>&                       chunks = inputs ? _readChunks : _writeChunks;
+
+	for (int i = 0, first = 0; i < requests.length(); i++)
+	{
+		Chunk chunk;
+		chunk.request = requests[i];
+		chunk.first = first;
+		chunk.offset = vars[first].offset;
+		chunk.size = 0;
+		for (int j = first; j < first + requests[i].items; j++)
+			chunk.size += vars[j].size;
+		first += requests[i].items;
+		chunks << chunk;
+	}
+	return true;
+}
+
+// resolves all variables and prepares their requests
+
+bool AdsProcessImage::prepare()
+{
+	_readChunks.clear();
+	_writeChunks.clear();
+	_handles.clear();
+
+	if (!prepare(_inputVars, true, _handles) || !prepare(_outputVars, false, _handles))
+	{
+		_plc->releaseHandles(_handles);
+		_handles.clear();
+		return false;
+	}
+	return true;
+}
+
+bool AdsProcessImage::start(double period)
+{
+	if (_thread)
+		return true;
+
+	if (!prepare())
+		return false;
+
+	// outputs are written every cycle, so they start with their values in the PLC instead of zeros
+
+	if (!readOutputs())
+	{
+		_plc->releaseHandles(_handles);
+		_handles.clear();
+		return false;
+	}
+	_ready = true;
+
+	_in[0] = ByteArray(_inputSize, 0);
+	_in[1] = ByteArray(_inputSize, 0);
+	_period = period;
+	_stop = false;
+
+	_thread = new AdsProcessImageThread;
+	_thread->_image = this;
+	_thread->start();
+	return true;
+}
+
+// reads the current values of all outputs into the output image
+
+bool AdsProcessImage::readOutputs()
+{
+	Array<BeckhoffAds::Handle> handles;
+	Array<int>                 sizes;
+	for (int i = 0; i < _outputVars.length(); i++)
+	{
+		handles << _handles[_inputVars.length() + i];
+		sizes << _outputVars[i].size;
+	}
+
+	ByteArray out(_outputSize, 0);
+	if (handles.length() > 0)
+	{
+		Array<BeckhoffAds::Result> results = _plc->sumRead(handles, sizes);
+		if (results.length() != handles.length())
+			return false;
+		for (int i = 0; i < results.length(); i++)
+		{
+			const Var& var = _outputVars[i];
+			if (results[i].error != 0 || results[i].data.length() != var.size)
+			{
+				ADS_LOG(ERROR, "process image output %s cannot be read", *var.name);
+				return false;
+			}
+			memcpy(out.ptr() + var.offset, results[i].data.ptr(), var.size);
+		}
+	}
+
+	Lock _(_outMutex);
+	_out = out;
+	return true;
+}
+
+void AdsProcessImage::stop()
+{
+	if (!_thread)
+		return;
+	_stop = true;
+	_thread->join();
+	delete _thread;
+	_thread = 0;
+	_plc->releaseHandles(_handles);
+	_handles.clear();
+}
+
+void AdsProcessImage::run()
+{
+	double next = now(), lastPrepare = 0;
+	int    reconnections = _plc->reconnections();
+
+	while (!_stop)
+	{
+		// handles of a lost connection are not valid after it is restored (the PLC may reuse their numbers, so they
+		// are not released); if variables cannot be resolved, that is retried every second
+
+		if (_plc->reconnections() != reconnections)
+		{
+			reconnections = _plc->reconnections();
+			_handles.clear();
+			_ready = false;
+			lastPrepare = 0;
+		}
+
+		if (!_ready && _plc->connected() && now() - lastPrepare > 1.0)
+		{
+			lastPrepare = now();
+			_ready = prepare();
+		}
+
+		if (_ready && _plc->connected())
+		{
+			double t0 = now();
+			cycle();
+			_lastCycleTime = now() - t0;
+			_cycles++;
+		}
+
+		next += _period;
+		double wait = next - now();
+		if (wait > 0)
+			sleep(wait);
+		else
+		{
+			_overruns++;
+			next = now();
+		}
+	}
+}
+
+void AdsProcessImage::cycle()
+{
+	if (_writeChunks.length() > 0)
+		writeOutputs();
+	if (_readChunks.length() > 0)
+		readInputs();
+}
+
+void AdsProcessImage::writeOutputs()
+{
+	{
+		Lock _(_outMutex);
+		foreach (Chunk& chunk, _writeChunks)
+			memcpy(chunk.request.data(), _out.ptr() + chunk.offset, chunk.size);
+	}
+
+	foreach (Chunk& chunk, _writeChunks)
+	{
+		if (!_plc->execute(chunk.request, &_response) || _response.length() < 4 * chunk.request.items)
+		{
+			_errors++;
+			continue;
+		}
+		StreamBufferReader reader(_response);
+		for (int i = 0; i < chunk.request.items; i++)
+			if (reader.read<unsigned>() != 0)
+				_errors++;
+	}
+}
+
+void AdsProcessImage::readInputs()
+{
+	int   back = 1 - _front;
+	byte* image = _in[back].ptr();
+
+	// the back buffer is marked as being written (odd count) while it is updated; it starts as a copy of the front
+	// buffer so that items that fail keep their last value
+
+	++_seq[back];
+	memcpy(image, _in[1 - back].ptr(), _inputSize);
+
+	foreach (Chunk& chunk, _readChunks)
+	{
+		int n = chunk.request.items;
+		if (!_plc->execute(chunk.request, &_response) || _response.length() < 4 * n + chunk.size)
+		{
+			_errors++;
+			continue;
+		}
+
+		// error codes of all items first, then their data
+
+		const byte* errors = _response.ptr();
+		const byte* data = errors + 4 * n;
+		for (int i = chunk.first; i < chunk.first + n; i++)
+		{
+			const Var& var = _inputVars[i];
+			unsigned   error;
+			AdsCodec::decode(errors, 1, &error);
+			if (error == 0)
+				memcpy(image + var.offset, data, var.size);
+			else
+				_errors++;
+			errors += 4;
+			data += var.size;
+		}
+	}
+
+	++_seq[back];
+	_front += back - _front; // publish the new snapshot
+}
+
+bool AdsProcessImage::readInput(int offset, void* data, int size) const
+{
+	if (offset < 0 || size < 0 || offset + size > _inputSize || _in[0].length() != _inputSize)
+		return false;
+
+	while (1)
+	{
+		int b = _front;
+		int s = _seq[b];
+		if (s & 1)
+			continue;
+		memcpy(data, _in[b].ptr() + offset, size);
+		if (_seq[b] == s)
+			break;
+	}
+	return true;
+}
+
+ByteArray AdsProcessImage::inputs() const
+{
+	ByteArray data(_inputSize);
+	if (!readInput(0, data.ptr(), _inputSize))
+		return ByteArray();
+	return data;
+}
+
+void AdsProcessImage::writeOutput(int offset, const void* data, int size)
+{
+	if (offset < 0 || size < 0 || offset + size > _outputSize)
+		return;
+	Lock _(_outMutex);
+	if (_out.length() != _outputSize) // not started
+		return;
+	memcpy(_out.ptr() + offset, data, size);
+}
@@ -0,0 +1,187 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef ASLADSPROCESSIMAGE_H
+#define ASLADSPROCESSIMAGE_H
+
+#include "BeckhoffAds.h"
+#include <asl/atomic.h>
+
+struct AdsProcessImageThread;
+
+/**
+ * Keeps a local copy of a set of PLC variables synchronized cyclically. Input variables are laid out one after the
+ * other in a local input image and output variables in an output image; a thread then runs, every period, one sum
+ * write of the outputs and one sum read of the inputs (more only if they do not fit in one request).
+ *
+ * Consumer threads read inputs from the latest complete snapshot without locks or network round trips: the image is
+ * double-buffered with a sequence count per buffer, so a read only retries if it overlaps an update of its buffer.
+ *
+ * ```
+ * AdsProcessImage image(plc);
+ * int speed = image.addInput<float>("GVL.speed");
+ * int count = image.addOutput<int>("GVL.count");
+ * image.start(0.005);
+ * ...
+ * float v = image.input<float>(speed);
+ * image.setOutput<int>(count, 0);
+ * ```
+ */
+class AdsProcessImage
+{
+	friend AdsProcessImageThread;
+
+public:
+	AdsProcessImage(BeckhoffAds& plc);
+	~AdsProcessImage();
+
+	/**
+	 * Adds an input variable of the given byte size and returns its offset in the input image (call before start)
+	 */
+	int addInput(const asl::String& name, int size);
+
+	/**
+	 * Adds an output variable of the given byte size and returns its offset in the output image (call before start)
+	 */
+	int addOutput(const asl::String& name, int size);
+
+	template<class T>
+	int addInput(const asl::String& name)
+	{
+		return addInput(name, sizeof(T));
+	}
+
+	template<class T>
+	int addOutput(const asl::String& name)
+	{
+		return addOutput(name, sizeof(T));
+	}
+
+	/**
+	 * Resolves the variables, initializes the output image with the current values of the outputs and starts the cycle
+	 * thread with a period in seconds, returns false if a variable cannot be resolved or read. The cycle runs until `stop()`: it pauses while the connection is lost and resolves the
+	 * variables again after a reconnection.
+	 */
+	bool start(double period);
+
+	/**
+	 * Stops the cycle thread and releases the variable handles
+	 */
+	void stop();
+
+	bool running() const { return _thread != 0; }
+
+	int inputSize() const { return _inputSize; }
+
+	int outputSize() const { return _outputSize; }
+
+	/**
+	 * Copies `size` bytes at an offset of the latest input snapshot, returns false if the range is not in the image
+	 * or the image was not started
+	 */
+	bool readInput(int offset, void* data, int size) const;
+
+	/**
+	 * Returns a copy of the whole latest input snapshot (empty if the image was not started)
+	 */
+	asl::ByteArray inputs() const;
+
+	/**
+	 * Returns the value of an input at the given offset, or T() if it cannot be read
+	 */
+	template<class T>
+	T input(int offset) const
+	{
+		asl::byte data[sizeof(T)];
+		T         value = T();
+		if (readInput(offset, data, sizeof(T)))
+			AdsCodec::decode(data, 1, &value);
+		return value;
+	}
+
+	/**
+	 * Sets `size` bytes of the output image at an offset, sent in the next cycle
+	 */
+	void writeOutput(int offset, const void* data, int size);
+
+	/**
+	 * Sets the value of an output at the given offset
+	 */
+	template<class T>
+	void setOutput(int offset, const T& value)
+	{
+		asl::byte data[sizeof(T)];
+		AdsCodec::encode(&value, 1, data);
+		writeOutput(offset, data, sizeof(T));
+	}
+
+	/**
+	 * Returns the number of cycles run
+	 */
+	int cycles() const { return _cycles; }
+
+	/**
+	 * Returns the number of cycles that took longer than the period
+	 */
+	int overruns() const { return _overruns; }
+
+	/**
+	 * Returns the number of failed requests or items
+	 */
+	int errors() const { return _errors; }
+
+	/**
+	 * Returns the duration of the last cycle in seconds
+	 */
+	double lastCycleTime() const { return _lastCycleTime; }
+
+protected:
+	struct Var
+	{
+		asl::String name;
+		int         size;
+		int         offset;
+	};
+
+	struct Chunk
+	{
+		BeckhoffAds::PreparedRequest request;
+		int                          first;  // index of the first variable
+		int                          offset; // offset of the first variable in the image
+		int                          size;   // size of the variables' data
+	};
+
+	bool prepare(const asl::Array<Var>& vars, bool inputs, asl::Array<BeckhoffAds::Handle>& handles);
+	bool prepare();
+	bool readOutputs();
+	void run();
+	void cycle();
+	void readInputs();
+	void writeOutputs();
+
+protected:
+	BeckhoffAds*                    _plc;
+	asl::Array<Var>                 _inputVars;
+	asl::Array<Var>                 _outputVars;
+	asl::Array<BeckhoffAds::Handle> _handles;
+	asl::Array<Chunk>               _readChunks;
+	asl::Array<Chunk>               _writeChunks;
+	int                             _inputSize;
+	int                             _outputSize;
+	asl::ByteArray                  _in[2];
+	mutable asl::AtomicCount        _seq[2];
+	asl::AtomicCount                _front;
+	asl::ByteArray                  _out;
+	asl::Mutex                      _outMutex;
+	asl::ByteArray                  _response;
+	AdsProcessImageThread*          _thread;
+	double                          _period;
+	volatile bool                   _stop;
+	bool                            _ready;
+	int                             _cycles;
+	int                             _overruns;
+	int                             _errors;
+	double                          _lastCycleTime;
+};
+
+#endif
@@ -0,0 +1,195 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#include "AdsReactor.h"
+#include <asl/Thread.h>
+#include <asl/time.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#define ADS_HAVE_EPOLL
+#endif
+
+using namespace asl;
+
+struct AdsReactorThread : public asl::Thread
+{
+	AdsReactor* _reactor;
+
+	void run() { _reactor->run(); }
+};
+
+AdsReactor::AdsReactor(int threads, int depth, AdsDispatcher::Overflow policy) : _dispatcher(threads, depth, policy)
+{
+	_thread = 0;
+	_threadId = 0;
+	_stop = false;
+	_epoll = -1;
+	_event = -1;
+#ifdef ADS_HAVE_EPOLL
+	_epoll = epoll_create1(EPOLL_CLOEXEC);
+	_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (_epoll >= 0 && _event >= 0)
+	{
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = 0; // the wakeup event
+		epoll_ctl(_epoll, EPOLL_CTL_ADD, _event, &ev);
+	}
+#endif
+}
+
+AdsReactor::~AdsReactor()
+{
+	if (_thread)
+	{
+		_stop = true;
+#ifdef ADS_HAVE_EPOLL
+		uint64_t one = 1;
+		if (::write(_event, &one, sizeof(one)) != sizeof(one))
+			ADS_LOG(ERROR, "cannot wake reactor");
+#endif
+		_thread->join();
+		delete _thread;
+	}
+	_dispatcher.stop();
+#ifdef ADS_HAVE_EPOLL
+	if (_event >= 0)
+		::close(_event);
+	if (_epoll >= 0)
+		::close(_epoll);
+#endif
+}
+
+bool AdsReactor::add(BeckhoffAds* ads)
+{
+#ifdef ADS_HAVE_EPOLL
+	if (_epoll < 0 || _event < 0)
+		return false;
+
+	Lock _(_mutex);
+
+	epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = ads;
+	if (epoll_ctl(_epoll, EPOLL_CTL_ADD, ads->_socket.handle(), &ev) != 0)
+	{
+		ADS_LOG(ERROR, "cannot add connection to reactor");
+		return false;
+	}
+	_connections[ads] = ads->_socket.handle();
+
+	if (!_thread)
+	{
+		_thread = new AdsReactorThread;
+		_thread->_reactor = this;
+		_thread->start();
+	}
+	return true;
+#else
+	(void)ads;
+	ADS_LOG(WARNING, "reactor not supported on this platform");
+	return false;
+#endif
+}
+
+void AdsReactor::remove(BeckhoffAds* ads)
+{
+	{
+		Lock _(_mutex);
+		if (!_connections.has(ads))
+			return;
+#ifdef ADS_HAVE_EPOLL
+		epoll_ctl(_epoll, EPOLL_CTL_DEL, _connections[ads], 0);
+#endif
+		_connections.remove(ads);
+	}
+
+	// wait until the reactor thread finishes the events it may be processing for this connection
+
+	if (!inReactorThread())
+	{
+		Lock _(_dispatchMutex);
+	}
+}
+
+bool AdsReactor::inReactorThread() const
+{
+#ifdef ADS_HAVE_EPOLL
+	return _thread && (ULong)pthread_self() == _threadId;
+#else
+	return false;
+#endif
+}
+
+void AdsReactor::run()
+{
+#ifdef ADS_HAVE_EPOLL
+	_threadId = (ULong)pthread_self();
+
+	const int   MAX_EVENTS = 64;
+	const int   TICK = 250; // ms between checks for request timeouts
+	epoll_event events[MAX_EVENTS];
+	double      nextTick = now() + TICK * 0.001;
+
+	while (!_stop)
+	{
+		int n = epoll_wait(_epoll, events, MAX_EVENTS, TICK);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			ADS_LOG(ERROR, "reactor wait failed (%i)", errno);
+			break;
+		}
+
+		Lock _(_dispatchMutex);
+
+		if (now() >= nextTick)
+		{
+			nextTick = now() + TICK * 0.001;
+			Array<BeckhoffAds*> connections;
+			{
+				Lock _(_mutex);
+				connections = _connections.keys();
+			}
+			foreach (BeckhoffAds* ads, connections)
+				ads->expireRequests();
+		}
+
+		for (int i = 0; i < n && !_stop; i++)
+		{
+			BeckhoffAds* ads = (BeckhoffAds*)events[i].data.ptr;
+			if (!ads)
+			{
+				uint64_t count;
+				if (::read(_event, &count, sizeof(count)) < 0)
+					ADS_LOG(ERROR, "reactor wakeup read failed");
+				continue;
+			}
+
+			// an earlier event of this round may have removed the connection
+
+			{
+				Lock _(_mutex);
+				if (!_connections.has(ads))
+					continue;
+			}
+
+			if (!ads->receive())
+			{
+				Lock _(_mutex);
+				if (_connections.has(ads))
+				{
+					epoll_ctl(_epoll, EPOLL_CTL_DEL, _connections[ads], 0);
+					_connections.remove(ads);
+				}
+			}
+		}
+	}
+#endif
+}
@@ -0,0 +1,74 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef ASLADSREACTOR_H
+#define ASLADSREACTOR_H
+
+#include "BeckhoffAds.h"
+
+struct AdsReactorThread;
+
+/**
+ * A single I/O thread that receives the responses and notifications of many BeckhoffAds connections (with epoll, on
+ * Linux), and an optional notification dispatcher shared by them. Connections use it if set before connecting:
+ *
+ * ```
+ * AdsReactor reactor;
+ * BeckhoffAds plc1, plc2;
+ * plc1.setReactor(&reactor);
+ * plc2.setReactor(&reactor);
+ * plc1.connect("192.168.1.10");
+ * plc2.connect("192.168.1.11");
+ * ```
+ *
+ * Sockets are read without blocking and frames are processed once fully received, so a slow peer does not stall the
+ * others. Asynchronous completions of all connections run in the reactor thread, so they must not block. Where the
+ * reactor is not supported connections fall back to their own receive thread. Disconnect all connections before
+ * destroying the reactor.
+ */
+class AdsReactor
+{
+	friend AdsReactorThread;
+
+public:
+	/**
+	 * Creates a reactor whose shared dispatcher has the given threads, depth and overflow policy (see
+	 * BeckhoffAds::setNotificationDispatch)
+	 */
+	AdsReactor(int threads = 2, int depth = 64, AdsDispatcher::Overflow policy = AdsDispatcher::DROP_OLDEST);
+	~AdsReactor();
+
+	/**
+	 * Starts receiving for a connected connection, returns false if not possible
+	 */
+	bool add(BeckhoffAds* ads);
+
+	/**
+	 * Stops receiving for a connection; when it returns, the reactor thread is no longer using it
+	 */
+	void remove(BeckhoffAds* ads);
+
+	/**
+	 * Returns the number of connections being received
+	 */
+	int connections() const { return _connections.length(); }
+
+	AdsDispatcher* dispatcher() { return &_dispatcher; }
+
+protected:
+	void run();
+	bool inReactorThread() const;
+
+protected:
+	asl::Mutex                  _mutex;
+	asl::Mutex                  _dispatchMutex;
+	asl::Map<BeckhoffAds*, int> _connections;
+	AdsDispatcher               _dispatcher;
+	AdsReactorThread*           _thread;
+	asl::ULong                  _threadId;
+	int                         _epoll;
+	int                         _event;
+	volatile bool               _stop;
+};
+
+#endif
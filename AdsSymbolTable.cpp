@@ -0,0 +1,124 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#include "AdsSymbolTable.h"
+#include <algorithm>
+#include <string.h>
+
+using namespace asl;
+
+struct KeyLess
+{
+	const Array<String>& keys;
+	KeyLess(const Array<String>& k) : keys(k) {}
+	bool operator()(int a, int b) const { return strcmp(*keys[a], *keys[b]) < 0; }
+};
+
+// matches a lowercase name against a lowercase pattern with * and ?
+
+static bool globMatch(const char* s, const char* p)
+{
+	const char* star = 0;
+	const char* retry = 0;
+	while (*s)
+	{
+		if (*p == '*')
+		{
+			star = ++p;
+			retry = s;
+		}
+		else if (*p == '?' || *p == *s)
+		{
+			p++;
+			s++;
+		}
+		else if (star)
+		{
+			p = star;
+			s = ++retry;
+		}
+		else
+			return false;
+	}
+	while (*p == '*')
+		p++;
+	return *p == 0;
+}
+
+void AdsSymbolTable::set(const Array<SymInfo>& symbols)
+{
+	_symbols = symbols;
+	_keys.resize(symbols.length());
+	_sorted.resize(symbols.length());
+	_index.clear();
+
+	for (int i = 0; i < symbols.length(); i++)
+	{
+		_keys[i] = symbols[i].name.toLowerCase();
+		_index[_keys[i]] = i;
+		_sorted[i] = i;
+	}
+
+	std::sort(_sorted.ptr(), _sorted.ptr() + _sorted.length(), KeyLess(_keys));
+}
+
+const AdsSymbolTable::SymInfo* AdsSymbolTable::find(const String& name) const
+{
+	int i = _index.get(name.toLowerCase(), -1);
+	return i < 0 ? 0 : &_symbols[i];
+}
+
+int AdsSymbolTable::lowerBound(const String& key) const
+{
+	int lo = 0, hi = _sorted.length();
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (strcmp(*_keys[_sorted[mid]], *key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+Array<const AdsSymbolTable::SymInfo*> AdsSymbolTable::prefix(const String& prefix) const
+{
+	Array<const SymInfo*> result;
+	String                key = prefix.toLowerCase();
+	for (int i = lowerBound(key); i < _sorted.length(); i++)
+	{
+		const String& name = _keys[_sorted[i]];
+		if (strncmp(*name, *key, key.length()) != 0)
+			break;
+		result << &_symbols[_sorted[i]];
+	}
+	return result;
+}
+
+Array<const AdsSymbolTable::SymInfo*> AdsSymbolTable::match(const String& pattern) const
+{
+	String key = pattern.toLowerCase();
+	int    n = (int)strcspn(*key, "*?");
+	if (n == key.length())
+	{
+		Array<const SymInfo*> result;
+		if (const SymInfo* sym = find(key))
+			result << sym;
+		return result;
+	}
+
+	// only names sharing the literal part before the first wildcard are tested
+
+	Array<const SymInfo*> result;
+	String                head = key.substring(0, n);
+	for (int i = lowerBound(head); i < _sorted.length(); i++)
+	{
+		const String& name = _keys[_sorted[i]];
+		if (strncmp(*name, *head, n) != 0)
+			break;
+		if (globMatch(*name + n, *key + n))
+			result << &_symbols[_sorted[i]];
+	}
+	return result;
+}
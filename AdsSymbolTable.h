@@ -0,0 +1,69 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef ASLADSSYMBOLTABLE_H
+#define ASLADSSYMBOLTABLE_H
+
+#include "BeckhoffAds.h"
+#include <asl/HashMap.h>
+
+/**
+ * An indexed copy of a PLC symbol table for fast lookups: by exact name (hashed) and by name prefix or wildcard
+ * pattern (on a sorted index). Names are matched case-insensitively, as in TwinCAT.
+ *
+ * ```
+ * AdsSymbolTable symbols(plc.getSymbols());
+ * const BeckhoffAds::SymInfo* speed = symbols.find("GVL.speed");
+ * float value = plc.readValue<float>(*speed);
+ * asl::Array<const BeckhoffAds::SymInfo*> axes = symbols.match("GVL.Axis*");
+ * ```
+ */
+class AdsSymbolTable
+{
+public:
+	typedef BeckhoffAds::SymInfo SymInfo;
+
+	AdsSymbolTable() {}
+	AdsSymbolTable(const asl::Array<SymInfo>& symbols) { set(symbols); }
+
+	/**
+	 * Replaces the table contents and rebuilds the indices
+	 */
+	void set(const asl::Array<SymInfo>& symbols);
+
+	/**
+	 * Returns the number of symbols
+	 */
+	int length() const { return _symbols.length(); }
+
+	/**
+	 * Returns the i-th symbol in the order of the PLC
+	 */
+	const SymInfo& operator[](int i) const { return _symbols[i]; }
+
+	/**
+	 * Returns the symbol with the given name, or null if there is none
+	 */
+	const SymInfo* find(const asl::String& name) const;
+
+	/**
+	 * Returns the symbols whose names start with the given prefix, sorted by name
+	 */
+	asl::Array<const SymInfo*> prefix(const asl::String& prefix) const;
+
+	/**
+	 * Returns the symbols whose names match a pattern with wildcards `*` (any sequence) and `?` (any character),
+	 * sorted by name
+	 */
+	asl::Array<const SymInfo*> match(const asl::String& pattern) const;
+
+protected:
+	int lowerBound(const asl::String& key) const;
+
+	asl::Array<SymInfo>            _symbols;
+	asl::Array<asl::String>        _keys;
+	asl::Array<int>                _sorted;
+	asl::HashMap<asl::String, int> _index;
+};
+
+#endif
@@ -0,0 +1,185 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef ASLADSVARIABLE_H
+#define ASLADSVARIABLE_H
+
+#include "BeckhoffAds.h"
+
+/**
+ * Static mapping of C++ types to ADS type codes. `accepts()` tells if a PLC variable of a given type code can be read
+ * as T; types without a mapping (structs) are only checked by size.
+ */
+template<class T>
+struct AdsType
+{
+	enum
+	{
+		CODE = BeckhoffAds::ADST_BIGTYPE,
+		ITEM = 1
+	};
+	static bool accepts(int) { return true; }
+};
+
+#define ADS_TYPE(T, code)                                    \
+	template<>                                               \
+	struct AdsType<T>                                        \
+	{                                                        \
+		enum                                                 \
+		{                                                    \
+			CODE = code,                                     \
+			ITEM = sizeof(T)                                 \
+		};                                                   \
+		static bool accepts(int c) { return c == CODE; }     \
+	};
+
+ADS_TYPE(bool, BeckhoffAds::ADST_BIT)
+ADS_TYPE(signed char, BeckhoffAds::ADST_INT8)
+ADS_TYPE(unsigned char, BeckhoffAds::ADST_UINT8)
+ADS_TYPE(short, BeckhoffAds::ADST_INT16)
+ADS_TYPE(unsigned short, BeckhoffAds::ADST_UINT16)
+ADS_TYPE(int, BeckhoffAds::ADST_INT32)
+ADS_TYPE(unsigned, BeckhoffAds::ADST_UINT32)
+ADS_TYPE(asl::Long, BeckhoffAds::ADST_INT64)
+ADS_TYPE(asl::ULong, BeckhoffAds::ADST_UINT64)
+ADS_TYPE(float, BeckhoffAds::ADST_REAL32)
+ADS_TYPE(double, BeckhoffAds::ADST_REAL64)
+
+#undef ADS_TYPE
+
+// plain char is commonly used for BOOL and BYTE variables
+
+template<>
+struct AdsType<char>
+{
+	enum
+	{
+		CODE = BeckhoffAds::ADST_INT8,
+		ITEM = 1
+	};
+	static bool accepts(int c)
+	{
+		return c == BeckhoffAds::ADST_BIT || c == BeckhoffAds::ADST_INT8 || c == BeckhoffAds::ADST_UINT8;
+	}
+};
+
+/**
+ * A PLC variable of type T bound once by name: the symbol's type code and size are checked against T and its handle
+ * is resolved at bind time, so reads and writes then send pre-encoded requests by handle without lookups or size
+ * checks. The handle is released when the object is destroyed or bound again, so it should not outlive the connection
+ * and is not copyable. An object should not be used from several threads at once.
+ *
+ * ```
+ * AdsVariable<float> speed(plc, "GVL.speed");
+ * if (!speed)
+ *     return; // not found or not a REAL
+ * float v = speed.read();
+ * speed.write(v * 2);
+ * ```
+ */
+template<class T>
+class AdsVariable
+{
+public:
+	enum
+	{
+		SIZE = sizeof(T),
+		TYPE = AdsType<T>::CODE
+	};
+
+	AdsVariable() : _plc(0) {}
+
+	AdsVariable(BeckhoffAds& plc, const asl::String& name) : _plc(0) { bind(plc, name); }
+
+	~AdsVariable() { unbind(); }
+
+	/**
+	 * Binds to a variable by name, returns false if it does not exist or its type does not match T
+	 */
+	bool bind(BeckhoffAds& plc, const asl::String& name)
+	{
+		unbind();
+		BeckhoffAds::SymInfo sym;
+		if (!plc.getSymbol(name, sym))
+			return false;
+		if (sym.size != SIZE || !AdsType<T>::accepts(sym.typecode))
+		{
+			ADS_LOG(ERROR, "variable %s is %s (%i bytes), not compatible with the requested type", *name, *sym.type,
+			        sym.size);
+			return false;
+		}
+		_handle = plc.getHandle(name);
+		if (!_handle)
+			return false;
+		_plc = &plc;
+		_name = name;
+		_read = plc.prepareRead(_handle, SIZE);
+		_write = plc.prepareWrite(_handle, SIZE);
+		return true;
+	}
+
+	/**
+	 * Releases the variable's handle in the PLC
+	 */
+	void unbind()
+	{
+		if (_plc && _plc->connected())
+			_plc->releaseHandle(_handle);
+		_plc = 0;
+		_handle = BeckhoffAds::Handle();
+	}
+
+	bool operator!() const { return _plc == 0; }
+
+	const asl::String& name() const { return _name; }
+
+	const BeckhoffAds::Handle& handle() const { return _handle; }
+
+	/**
+	 * Reads the value, returns false on error
+	 */
+	bool read(T& value)
+	{
+		if (!_plc)
+			return false;
+		if (!_plc->execute(_read, &_data) || _data.length() != SIZE)
+			return false;
+		AdsCodec::convert(_data.ptr(), SIZE, AdsType<T>::ITEM, (asl::byte*)&value);
+		return true;
+	}
+
+	/**
+	 * Reads the value, or returns T() on error
+	 */
+	T read()
+	{
+		T value = T();
+		read(value);
+		return value;
+	}
+
+	/**
+	 * Writes the value
+	 */
+	bool write(const T& value)
+	{
+		if (!_plc)
+			return false;
+		AdsCodec::convert((const asl::byte*)&value, SIZE, AdsType<T>::ITEM, _write.data());
+		return _plc->execute(_write);
+	}
+
+protected:
+	AdsVariable(const AdsVariable&);
+	AdsVariable& operator=(const AdsVariable&);
+
+protected:
+	BeckhoffAds*                 _plc;
+	BeckhoffAds::Handle          _handle;
+	asl::String                  _name;
+	BeckhoffAds::PreparedRequest _read;
+	BeckhoffAds::PreparedRequest _write;
+	asl::ByteArray               _data;
+};
+
+#endif
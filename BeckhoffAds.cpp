@@ -3,35 +3,29 @@
 
 // https://infosys.beckhoff.com/
 
-#define NOTIF_THREAD // notifications start a thread each
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
 
 #include "BeckhoffAds.h"
 #include <asl/StreamBuffer.h>
 #include <asl/Thread.h>
 #include <asl/Date.h>
+#include <asl/File.h>
+#include <asl/atomic.h>
+#include <asl/time.h>
+#include "AdsReactor.h"
 
 typedef unsigned int   uint32_t;
 typedef unsigned short uint16_t;
 
 using namespace asl;
 
-inline ULong pack(unsigned cmd, unsigned invokeId)
-{
-	return ULong(cmd) << 32 | invokeId;
-}
-
-struct NotifThread : public asl::Thread
-{
-	const ByteArray                        data;
-	asl::Function<void, const ByteArray&>* func;
-	NotifThread(const ByteArray& b, asl::Function<void, const ByteArray&>& f) : data(b), func(&f) { start(); }
-	void run()
-	{
-		(*func)(data);
-		delete this;
-	}
-};
-
 enum AdsCommand
 {
 	ADSCOM_INVALID,
@@ -61,11 +55,44 @@ enum AdsIndexGroup
 	ADSIGRP_DOWNLOAD = 0xF00A,
 	ADSIGRP_SYM_UPLOAD = 0xF00B,
 	ADSIGRP_SYM_UPLOADINFO = 0xF00C,
+	ADSIGRP_SYM_DT_UPLOAD = 0xF00E,
+	ADSIGRP_SYM_UPLOADINFO2 = 0xF00F,
+	ADSIGRP_SUMUP_READ = 0xF080,
+	ADSIGRP_SUMUP_WRITE = 0xF081,
+	ADSIGRP_SUMUP_READWRITE = 0xF082,
 	ADSIGRP_DEVICE_DATA = 0xF100,
 	ADSIOFFS_DEVDATA_ADSSTATE = 0,
 	ADSIOFFS_DEVDATA_DEVSTATE = 2,
 };
 
+enum AdsState
+{
+	ADSSTATE_RUN = 5
+};
+
+enum AdsError
+{
+	ADSERR_INVALID_HANDLE = 1809
+};
+
+// the ADS server accepts up to 500 sub-commands in a sum command; block transfers keep a few chunks in flight
+
+const int ADS_MAX_SUM_ITEMS = 500;
+const int ADS_BLOCK_WINDOW = 8;
+
+// positions of fields patched in encoded frames (AMS/TCP header + AMS header)
+
+const int AMS_COMMAND_POS = 22;
+const int AMS_INVOKEID_POS = 34;
+
+// groups known to address bytes (PLC memory %M, PLC data, inputs %I and outputs %Q), which can be transferred in
+// chunks at increasing offsets; other groups (bit access, NC, port-specific) only with explicit readBlock/writeBlock
+
+inline bool isByteAddressed(unsigned group)
+{
+	return group == 0x4020 || group == 0x4025 || group == 0xF020 || group == 0xF030;
+}
+
 asl::Map<int, asl::String> adsErrors = String("6:Port not found,"
                                               "7:Target not found,"
                                               "18:Port disabled,"
@@ -89,7 +116,7 @@ void BeckhoffAds::NetId::set(const asl::String& s)
 	Array<String> parts = s.split('.');
 	if (parts.length() != 6)
 	{
-		printf("ADS: Bad NetID %s\n", *s);
+		ADS_LOG(ERROR, "Bad NetID %s", *s);
 		return;
 	}
 	for (int i = 0; i < 6; i++)
@@ -101,6 +128,24 @@ String BeckhoffAds::NetId::toString() const
 	return data.join('.');
 }
 
+// notification handler for the symbol version, which changes when a new PLC program is activated
+
+struct SymVersionHandler
+{
+	BeckhoffAds* ads;
+	SymVersionHandler(BeckhoffAds* a) : ads(a) {}
+	void operator()(const ByteArray& data) { ads->symbolVersionChanged(data); }
+};
+
+// notification handler for the ADS state, to detect PLC restarts
+
+struct StateHandler
+{
+	BeckhoffAds* ads;
+	StateHandler(BeckhoffAds* a) : ads(a) {}
+	void operator()(const ByteArray& data) { ads->stateChanged(data); }
+};
+
 struct BeckhoffThread : public asl::Thread
 {
 	BeckhoffAds* _ads;
@@ -113,37 +158,160 @@ void BeckhoffThread::run()
 	_ads->receiveLoop();
 }
 
+struct BeckhoffReconnectThread : public asl::Thread
+{
+	BeckhoffAds* _ads;
+
+	void run();
+};
+
+void BeckhoffReconnectThread::run()
+{
+	_ads->_reconnectThreadId = adsThreadId(); // to let onReconnect() callbacks disconnect
+	_ads->reconnectLoop();
+}
+
+// instance ids make notification handles of different connections distinct in a shared dispatcher
+
+static AtomicCount adsInstances;
+
+inline ULong dispatchKey(int id, unsigned handle)
+{
+	return ((ULong)id << 32) | handle;
+}
+
 BeckhoffAds::BeckhoffAds()
 {
+	_id = ++adsInstances;
+	_reactor = 0;
+	_attached = false;
+	_sharedDispatch = false;
 	_connected = false;
 	_sourcePort = (uint16_t)34000;
 	_targetPort = 851;
+	_tcpPort = 48898;
 	_invokeId = 0;
 	_thread = 0;
 	_lastError = 0;
 	_adsError = 0;
+	_useHandleCache = false;
+	_symVersion = -1;
+	_dispatcher = new AdsDispatcher();
+	_header.resize(38);
+	_framePos = 0;
+	_frameData = 0;
+	_frameLeft = 0;
+	_maxFrame = 4 << 20;
+	_timeout = 5;
+	_nextExpiry = 0;
+	_maxChunk = 0xFF00;
+	_wakeup[0] = _wakeup[1] = -1;
+	_autoReconnect = false;
+	_maxReconnectDelay = 5;
+	_reconnectThread = 0;
+	_stopReconnect = false;
+	_plcRestarted = false;
+	_plcState = -1;
+	_reconnectThreadId = 0;
+}
+
+bool BeckhoffAds::setLimits(int maxFrame, int maxChunk)
+{
+	if (maxFrame < 128 || maxChunk < 64)
+	{
+		ADS_LOG(ERROR, "invalid limits (frame %i, chunk %i)", maxFrame, maxChunk);
+		return false;
+	}
+	_maxFrame = maxFrame;
+	_maxChunk = min(maxChunk, _maxFrame - 64);
+	return true;
 }
 
 BeckhoffAds::~BeckhoffAds()
 {
 	disconnect();
-	sleep(0.1);
+	delete _dispatcher;
+}
+
+// the receive path uses the dispatcher and reactor without locks, and connect() may already add notifications (to
+// watch the symbol version or the PLC state), so they can only be changed with no connection and no notifications
+
+bool BeckhoffAds::configurable()
+{
+	Lock _(_mutex);
+	if (_connected || _thread || _attached || _reconnectThread || _callbacks.length() > 0)
+	{
+		ADS_LOG(ERROR, "notification dispatch and reactor must be set before connecting");
+		return false;
+	}
+	return true;
+}
+
+bool BeckhoffAds::setNotificationDispatch(int threads, int depth, AdsDispatcher::Overflow policy)
+{
+	if (!configurable())
+		return false;
+	AdsDispatcher* old = _dispatcher;
+	_dispatcher = new AdsDispatcher(threads, depth, policy);
+	delete old;
+	return true;
+}
+
+bool BeckhoffAds::setReactor(AdsReactor* reactor, bool sharedDispatch)
+{
+	if (!configurable())
+		return false;
+	_reactor = reactor;
+	_sharedDispatch = reactor && sharedDispatch;
+	return true;
+}
+
+AdsDispatcher* BeckhoffAds::dispatcher()
+{
+	return _sharedDispatch ? _reactor->dispatcher() : _dispatcher;
 }
 
 bool BeckhoffAds::connect(const String& host, int adsPort)
 {
+	if (_thread || _attached || _reconnectThread) // a lost connection is still being received or reconnected
+		disconnect();
 	_host = host | "127.0.0.1";
+	if (adsPort >= 0)
+		_targetPort = adsPort;
+
+	if (!open())
+		return false;
+
+	if (_useHandleCache)
+		watchSymbolVersion();
+
+	if (_autoReconnect)
+	{
+		{
+			Lock _(_mutex);
+			_plcState = -1;
+		}
+		watchState();
+		_stopReconnect = false;
+		_reconnectThread = new BeckhoffReconnectThread;
+		_reconnectThread->_ads = this;
+		_reconnectThread->start();
+	}
+	return true;
+}
+
+// opens the connection and starts receiving
+
+bool BeckhoffAds::open()
+{
 	_lastError = _adsError = 0;
 	Lock _(_mutex);
 	_socket = Socket();
-	_connected = _socket.connect(_host, 48898);
-
-	if (adsPort >= 0)
-		_targetPort = adsPort;
+	_connected = _socket.connect(_host, _tcpPort);
 
 	if (!_connected)
 	{
-		printf("ADS: Error connecting\n");
+		ADS_LOG(ERROR, "Error connecting");
 	}
 	else
 	{
@@ -161,41 +329,111 @@ bool BeckhoffAds::connect(const String& host, int adsPort)
 				_sourcePort = (unsigned short)res[12] | ((unsigned short)res[13] << 8);
 			}
 			else
-				printf("oops\n");
+				ADS_LOG(WARNING, "unexpected port registration response");
 		}
 
-		_thread = new BeckhoffThread;
-		_thread->_ads = this;
-		_thread->start();
+		_framePos = 0;
+		if (_reactor)
+			_attached = _reactor->add(this);
+
+		if (!_attached)
+		{
+#ifndef _WIN32
+			if (::pipe(_wakeup) != 0)
+				_wakeup[0] = _wakeup[1] = -1;
+#endif
+			_thread = new BeckhoffThread;
+			_thread->_ads = this;
+			_thread->start();
+		}
 	}
 	return _connected;
 }
 
 void BeckhoffAds::disconnect()
 {
-	if (!_connected)
-		return;
-	foreach (unsigned h, _notifications)
-		removeNotification(h);
+	stopReconnect();
+
+	// the connection may be closed already (lost, or while reconnecting), then only local state is cleared
+
+	bool open = _thread || _attached;
+
+	if (open)
+	{
+		Array<unsigned> notifications;
+		{
+			Lock _(_mutex);
+			notifications = _subscriptions.keys();
+		}
+		foreach (unsigned h, notifications)
+			removeNotification(h);
+
+		Array<Handle>   handles;
+		Array<unsigned> named = _handles.keys();
+		foreach (unsigned h, named)
+			handles << h;
+		foreach (unsigned h, _staleHandles)
+			handles << h;
+		foreach (Handle& h, _handleCache)
+			handles << h;
+		releaseHandles(handles);
+	}
+
+	{
+		Lock _(_mutex);
+		_handles.clear();
+		_staleHandles.clear();
+		_handleCache.clear();
+		_symVersion = -1;
+		_subscriptions.clear();
+		_notifAlias.clear();
+		_callbacks.clear();
+	}
+
+	if (open)
+		closeConnection();
+}
 
-	foreach (unsigned h, _handles)
-		releaseHandle(h);
+// stops receiving and closes the socket; all requests have been answered or canceled by now, so the receive thread
+// is stopped without waiting for more input
 
-	_handles.clear();
-	_notifications.clear();
-	sleep(0.2);
+void BeckhoffAds::closeConnection()
+{
 	_connected = false;
-	if (_thread)
-		_thread->join();
+
+	if (_attached)
+	{
+		_reactor->remove(this);
+		_attached = false;
+		cancelRequests();
+		_socket.close();
+		return;
+	}
+
+	if (!_thread)
+		return;
+
+	wakeReceiver();
+	_thread->join();
 	delete _thread;
+	_thread = 0;
 	_socket.close();
+
+#ifndef _WIN32
+	if (_wakeup[0] >= 0)
+	{
+		::close(_wakeup[0]);
+		::close(_wakeup[1]);
+		_wakeup[0] = _wakeup[1] = -1;
+	}
+#endif
 }
 
 bool BeckhoffAds::checkConnection()
 {
 	if (_connected && _socket.disconnected())
 	{
-		printf("ADS: Peer disconnected (invokeid: %u)\n", _invokeId);
+		ADS_LOG(ERROR, "Peer disconnected (invokeid: %u)", _invokeId);
 		_lastError = -5;
 		_connected = false;
 	}
@@ -214,47 +452,243 @@ void BeckhoffAds::setTarget(const BeckhoffAds::NetId& net, int port)
 	_targetPort = (uint16_t)port;
 }
 
-bool BeckhoffAds::send(int command, const ByteArray& data)
+ByteArray BeckhoffAds::encodeFrame(int command, const ByteArray& data)
 {
-	Lock _(_mutex);
-
-	_adsError = 0;
-
 	StreamBuffer buffer(ENDIAN_LITTLE);
 
 	buffer << uint16_t(0) << uint32_t(data.length() + 32); // AMS/TCP Header
 	buffer << _target.data << uint16_t(_targetPort) << _source.data << uint16_t(_sourcePort);
 	buffer << uint16_t(command) << uint16_t(0x0004) << uint32_t(data.length());
-	buffer << uint32_t(0) << uint32_t(_invokeId);
+	buffer << uint32_t(0) << uint32_t(0); // invokeId set when sent
 	buffer << data;
 
-	int n = _socket.write(buffer.ptr(), buffer.length());
-	if (n != buffer.length())
+	return *buffer;
+}
+
+bool BeckhoffAds::send(int command, const ByteArray& data, Request& req)
+{
+	ByteArray frame = encodeFrame(command, data);
+	return sendFrame(frame, req);
+}
+
+bool BeckhoffAds::sendFrame(ByteArray& frame, Request& req)
+{
+	Lock _(_mutex);
+
+	if (!_connected)
+		return false;
+
+	AdsCodec::encode(&_invokeId, 1, frame.ptr() + AMS_INVOKEID_POS);
+
+	// register before writing, the response may arrive before write() returns
+
+	req.command = frame[AMS_COMMAND_POS] | (frame[AMS_COMMAND_POS + 1] << 8);
+	req.invokeId = _invokeId;
+	req.sent = now();
+	_requests[_invokeId] = &req;
+
+	_invokeId = (_invokeId + 1) % (1 << 30);
+
+	int n = _socket.write(frame.ptr(), frame.length());
+	if (n != frame.length())
 	{
-		printf("ADS: send failed %i\n", n);
+		ADS_LOG(ERROR, "send failed %i", n);
 		_lastError = -6;
+		_requests.remove(req.invokeId);
 		return false;
 	}
 
-	_lastRequestId = pack(command, _invokeId);
-
-	_invokeId = (_invokeId + 1) % (1 << 30);
+	_metrics.framesOut++;
+	_metrics.bytesOut += n;
+	if (req.command >= 0 && req.command < AdsMetrics::COMMANDS)
+		++_metrics.requests[req.command];
 
 	return true;
 }
 
+void BeckhoffAds::cancelRequests()
+{
+	Array<Request*> requests;
+	{
+		Lock _(_mutex);
+		foreach (Request* req, _requests)
+			requests << req;
+		_requests.clear();
+	}
+	foreach (Request* req, requests)
+		finish(req);
+}
+
+// fails the requests that were not answered within the timeout; called periodically by the receiving thread
+
+void BeckhoffAds::expireRequests()
+{
+	double t = now();
+	if (_timeout <= 0 || t < _nextExpiry)
+		return;
+	_nextExpiry = t + _timeout / 4;
+
+	Array<Request*> expired;
+	{
+		Lock            _(_mutex);
+		Array<unsigned> ids;
+		foreach2 (unsigned id, Request* req, _requests)
+			if (t - req->sent > _timeout)
+				ids << id;
+		foreach (unsigned id, ids)
+		{
+			expired << _requests[id];
+			_requests.remove(id);
+		}
+	}
+	foreach (Request* req, expired)
+	{
+		ADS_LOG(ERROR, "Timeout waiting response (invokeid: %u)", req->invokeId);
+		++_metrics.timeouts;
+		req->timedOut = true;
+		finish(req);
+	}
+}
+
+void BeckhoffAds::finish(Request* req)
+{
+	if (!req->completion)
+	{
+		req->done.post();
+		return;
+	}
+	req->completion->complete(*this, *req);
+	delete req->completion;
+	delete req;
+}
+
 void BeckhoffAds::receiveLoop()
 {
 	while (_connected)
 	{
-		if (_socket.waitInput(1))
+		int input = waitInput(_timeout > 0 ? _timeout / 4 : -1);
+		if (input < 0 || !_connected)
+			break;
+		if (input > 0)
 		{
 			if (_socket.disconnected())
 				break;
-			ByteArray data = readPacket();
+			readPacket();
+		}
+		expireRequests();
+	}
+	cancelRequests();
+	connectionLost();
+}
+
+// called by a reactor when the socket has input, returns false when the connection is over; the reactor thread is
+// shared, so it reads only what is available and processes frames once they are complete
+
+bool BeckhoffAds::receive()
+{
+#ifdef _WIN32
+	if (checkConnection())
+		readPacket();
+#else
+	while (_connected)
+	{
+		int size = 6;
+		if (_framePos >= 6)
+		{
+			uint16_t reserved = 0;
+			uint32_t totalLen = 0;
+			StreamBufferReader(_frame.ptr(), 6) >> reserved >> totalLen;
+			if (reserved != 0 || totalLen < 32 || totalLen > (uint32_t)_maxFrame)
+			{
+				ADS_LOG(ERROR, "bad comm (len=%i reserved=%i)", totalLen, reserved);
+				_lastError = -4;
+				_connected = false;
+				break;
+			}
+			size = 6 + totalLen;
 		}
+		if (_framePos == size)
+		{
+			_frameData = _frame.ptr();
+			_frameLeft = size;
+			readPacket();
+			_frameData = 0;
+			_frameLeft = 0;
+			_framePos = 0;
+			continue;
+		}
+		if (_frame.length() < size)
+			_frame.resize(size);
+		int m = (int)::recv(_socket.handle(), (char*)_frame.ptr() + _framePos, size - _framePos, MSG_DONTWAIT);
+		if (m > 0)
+			_framePos += m;
+		else if (m < 0 && errno == EINTR)
+			continue;
+		else if (m < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		else
+		{
+			ADS_LOG(ERROR, "Peer disconnected (invokeid: %u)", _invokeId);
+			_lastError = -5;
+			_connected = false;
+		}
+	}
+#endif
+	if (!_connected)
+	{
+		cancelRequests();
+		connectionLost();
+		return false;
+	}
+	return true;
+}
+
+// blocks until the socket has input (returns 1), the timeout in seconds expires (0, a negative timeout waits forever)
+// or the receive thread is woken up to stop (-1)
+
+int BeckhoffAds::waitInput(double timeout)
+{
+	int ms = timeout < 0 ? -1 : int(timeout * 1000) + 1;
+#ifdef _WIN32
+	WSAPOLLFD fd;
+	fd.fd = (SOCKET)_socket.handle();
+	fd.events = POLLRDNORM;
+	fd.revents = 0;
+	int n = WSAPoll(&fd, 1, ms);
+	return n > 0 ? 1 : n == 0 ? 0 : -1;
+#else
+	pollfd fds[2];
+	fds[0].fd = _socket.handle();
+	fds[0].events = POLLIN;
+	fds[1].fd = _wakeup[0];
+	fds[1].events = POLLIN;
+	while (1)
+	{
+		fds[0].revents = fds[1].revents = 0;
+		int n = ::poll(fds, _wakeup[0] >= 0 ? 2 : 1, ms);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n == 0)
+			return 0;
+		return n > 0 && fds[1].revents == 0 ? 1 : -1;
+	}
+#endif
+}
+
+void BeckhoffAds::wakeReceiver()
+{
+#ifdef _WIN32
+	shutdown((SOCKET)_socket.handle(), SD_BOTH); // there are no pipes to poll; this ends WSAPoll and reads
+#else
+	if (_wakeup[1] >= 0)
+	{
+		char c = 1;
+		if (::write(_wakeup[1], &c, 1) != 1)
+			shutdown(_socket.handle(), SHUT_RDWR);
 	}
-	_newdata.post();
+	else
+		shutdown(_socket.handle(), SHUT_RDWR);
+#endif
 }
 
 void BeckhoffAds::processNotification(const ByteArray& data)
@@ -263,175 +697,316 @@ void BeckhoffAds::processNotification(const ByteArray& data)
 	uint32_t           length = 0, stamps = 0;
 	buffer >> length >> stamps;
 
-	for (unsigned i = 0; i < stamps; i++)
+	// group the samples of each handle in this frame, their data points into the frame
+
+	Map<unsigned, AdsDispatcher::Batch> batches;
+	Array<unsigned>                     handles;
+	bool                                ok = true;
+
+	for (unsigned i = 0; i < stamps && ok; i++)
 	{
 		if (buffer.length() < 12)
-			return;
+			break;
 		ULong    time = 0;
 		uint32_t samples = 0;
 		buffer >> time >> samples;
-		Date t = time * 100e-9 - 11644473600.0;
+		double t = time * 100e-9 - 11644473600.0; // FILETIME to Unix time
 
 		for (unsigned j = 0; j < samples; j++)
 		{
 			if (buffer.length() < 8)
-				return;
+			{
+				ok = false;
+				break;
+			}
 			uint32_t handle = 0, size = 0;
 			buffer >> handle >> size;
 			if ((unsigned)buffer.length() < size)
 			{
-				return;
+				ok = false;
+				break;
 			}
-			if (_callbacks.has(handle))
-#ifndef NOTIF_THREAD
-				_callbacks[handle](buffer.read(size)); // send more info, like timestamp??
-#else
-				new NotifThread(buffer.read(size), _callbacks[handle]);
-#endif
-			else
+			AdsSample sample = { t, handle, buffer.ptr(), (int)size };
+			if (!batches.has(handle))
 			{
-				buffer.skip(size);
+				batches[handle].frame = data;
+				handles << handle;
 			}
-			// buffer.skip(size); // this is the actual data
-			// printf("  notification at %s.%i for handle %u size %u\n", *t.toUTCString(), int(1000*fract(t.time())),
-			// handle, size);
+			batches[handle].samples << sample;
+			buffer.skip(size);
+			_metrics.samples++;
 		}
 	}
-}
 
-ByteArray BeckhoffAds::readPacket()
-{
-	ByteArray data;
-	if (!checkConnection())
-		return data;
-	uint16_t reserved = 0;
-	uint32_t totalLen = 0;
-	data = _socket.read(6);
-	if (data.length() < 6)
-		return data.resize(0);
-	StreamBufferReader reader(data);
-	reader >> reserved >> totalLen;
-	if (_socket.error() || reserved != 0 || totalLen > 5000)
+	// after a reconnection notifications can have new handles, samples get those known by the application
+
+	Array<AdsDispatcher::Callback> callbacks(handles.length());
+	Array<bool>                    found(handles.length());
+	Array<unsigned>                keys(handles.length());
+	Lock                           posting(_postMutex);
 	{
-		printf("ADS: bad comm (len=%i reserved=%i, read=%i)\n", totalLen, reserved, data.length());
-		_lastError = -4;
-		_newdata.post();
-		return data.resize(0);
+		Lock _(_mutex);
+		for (int i = 0; i < handles.length(); i++)
+		{
+			if ((found[i] = _callbacks.has(handles[i])))
+				callbacks[i] = _callbacks[handles[i]];
+			keys[i] = _notifAlias.has(handles[i]) ? _notifAlias[handles[i]] : handles[i];
+		}
 	}
-	data = _socket.read(totalLen);
-	StreamBufferReader buffer(data);
-
-	uint16_t portT, portS, commandId, flags;
-	buffer.skip(6); // target net
-	buffer >> portT;
-	buffer.skip(6); // source net
-	buffer >> portS;
-
-	if (portT != _sourcePort || portS != _targetPort) // not my conversation
-		return data.resize(0);
 
-	uint32_t len = 0, error = 0, invokeId;
-	buffer >> commandId >> flags >> len >> error >> invokeId;
-	if (buffer.length() != len)
-		printf("ADS: len=%u, remaining=%i\n", len, buffer.length());
-	if (error != 0)
+	for (int i = 0; i < handles.length(); i++)
 	{
-		_adsError = error;
-		printf("ADS: error: (%u) %s\n", error, *adsErrors[error]);
-		_newdata.post();
-		return data.resize(0); // 8?
+		if (!found[i])
+			continue;
+		AdsDispatcher::Batch& batch = batches[handles[i]];
+		if (keys[i] != handles[i])
+			foreach (AdsSample& sample, batch.samples)
+				sample.handle = keys[i];
+		dispatcher()->post(dispatchKey(_id, keys[i]), callbacks[i], batch);
 	}
+}
 
-	data = buffer.read(len);
-
-	if ((flags & 1) == 0 && commandId != ADSCOM_DEVICENOTIF)
+bool BeckhoffAds::readFully(byte* data, int n)
+{
+	if (_frameData) // a frame already received by a reactor
 	{
-		printf("ADS: received request, not response (cmd: %u)\n", commandId);
-		return data.resize(0);
+		if (n > _frameLeft)
+			return false;
+		memcpy(data, _frameData, n);
+		_frameData += n;
+		_frameLeft -= n;
+		return true;
 	}
-
-	Lock _(_mutex);
-
-	switch (commandId)
+	while (n > 0)
 	{
-	case ADSCOM_DEVICENOTIF:
-		processNotification(data);
-		break;
-	case ADSCOM_READSTATE:
-	case ADSCOM_READWRITE:
-	case ADSCOM_READ:
-	case ADSCOM_WRITE:
-	case ADSCOM_ADDDEVICENOTIF:
-	case ADSCOM_DELDEVICENOTIF:
-	case ADSCOM_READDEVICEINFO:
-	case ADSCOM_WRITECTRL:
-		_response = data.clone();
-		_responses[pack(commandId, invokeId)] = _response;
-		_newdata.post();
-		break;
-	default:;
-	}
-	return data;
+		int m = _socket.read(data, n);
+		if (m <= 0)
+			return false;
+		data += m;
+		n -= m;
+	}
+	return true;
 }
 
-bool BeckhoffAds::hasError() const
+bool BeckhoffAds::skipBytes(int n)
 {
-	return _adsError != 0;
+	if (_frameData)
+	{
+		if (n > _frameLeft)
+			return false;
+		_frameData += n;
+		_frameLeft -= n;
+		return true;
+	}
+	if (_rxBuffer.length() < n)
+		_rxBuffer.resize(n);
+	return readFully(_rxBuffer.ptr(), n);
 }
 
-bool BeckhoffAds::hasFatalError() const
+bool BeckhoffAds::readPacket()
 {
-	return _lastError != 0;
-}
+	if (!_frameData && !checkConnection())
+		return false;
 
-ByteArray BeckhoffAds::getResponse()
-{
-	for (int i = 0; i < 5; i++)
+	// headers are read into a reused buffer, the body goes straight into the buffer of its destination
+
+	uint16_t reserved = 0;
+	uint32_t totalLen = 0;
+	if (!readFully(_header.ptr(), 6))
+		return false;
+	StreamBufferReader reader(_header);
+	reader >> reserved >> totalLen;
+	if (_socket.error() || reserved != 0 || totalLen < 32 || totalLen > (uint32_t)_maxFrame)
+	{
+		ADS_LOG(ERROR, "bad comm (len=%i reserved=%i)", totalLen, reserved);
+		_lastError = -4;
+
+		// the frame boundary is lost, so the connection is given up (and reopened with auto-reconnect)
+
+		_connected = false;
+		cancelRequests();
+		return false;
+	}
+	if (!readFully(_header.ptr() + 6, 32))
+		return false;
+
+	_metrics.framesIn++;
+	_metrics.bytesIn += 6 + totalLen;
+
+	uint16_t portT, portS, commandId, flags;
+	reader.skip(6); // target net
+	reader >> portT;
+	reader.skip(6); // source net
+	reader >> portS;
+
+	uint32_t len = 0, error = 0, invokeId;
+	reader >> commandId >> flags >> len >> error >> invokeId;
+
+	int bodyLen = totalLen - 32;
+	if (bodyLen != (int)len)
+		ADS_LOG(WARNING, "len=%u, remaining=%i", len, bodyLen);
+	int dataLen = min((int)len, bodyLen);
+
+	if (portT != _sourcePort || portS != _targetPort) // not my conversation
+		return skipBytes(bodyLen);
+
+	if (error != 0)
+	{
+		_metrics.error(error);
+		ADS_LOG(ERROR, "error: (%u) %s", error, *adsErrors[error]);
+		Request* req = 0;
+		{
+			Lock _(_mutex);
+			if (_requests.has(invokeId))
+			{
+				req = _requests[invokeId];
+				_requests.remove(invokeId);
+			}
+		}
+		if (req)
+		{
+			if (req->command < AdsMetrics::COMMANDS)
+				_metrics.roundTrip[req->command].add(now() - req->sent);
+			req->error = error;
+			req->received = true;
+			finish(req);
+		}
+		return skipBytes(bodyLen);
+	}
+
+	if ((flags & 1) == 0 && commandId != ADSCOM_DEVICENOTIF)
+	{
+		ADS_LOG(WARNING, "received request, not response (cmd: %u)", commandId);
+		return skipBytes(bodyLen);
+	}
+
+	// notifications are processed without the lock, the dispatcher may block with the BLOCK overflow policy;
+	// each frame gets its own buffer as the queued samples point into it
+
+	if (commandId == ADSCOM_DEVICENOTIF)
+	{
+		ByteArray data(dataLen);
+		if (!readFully(data.ptr(), dataLen))
+			return false;
+		_metrics.notificationFrames++;
+		processNotification(data);
+		return skipBytes(bodyLen - dataLen);
+	}
+
+	// a response is read directly into its request, which is taken out of the pending list so that it stays valid
+
+	Request* req = 0;
 	{
-		_newdata.wait();
 		Lock _(_mutex);
-		if (_adsError != 0)
-			return ByteArray();
-		if (!_responses.has(_lastRequestId))
+		if (_requests.has(invokeId) && _requests[invokeId]->command == commandId)
 		{
-			printf("ADS: Timeout waiting response\n");
-			_lastError = -3;
-			return ByteArray();
+			req = _requests[invokeId];
+			_requests.remove(invokeId);
 		}
+	}
 
-		ByteArray res = _responses[_lastRequestId];
+	if (!req)
+	{
+		ADS_LOG(WARNING, "unexpected response (cmd: %u, invokeid: %u)", commandId, invokeId);
+		return skipBytes(bodyLen);
+	}
+
+	// the request may be gone once finished
 
-		_responses.remove(_lastRequestId);
-		return res;
+	req->data.resize(dataLen);
+	bool ok = readFully(req->data.ptr(), dataLen);
+	req->received = ok;
+
+	// all responses start with the ADS result code
+
+	if (ok)
+	{
+		if (req->command < AdsMetrics::COMMANDS)
+			_metrics.roundTrip[req->command].add(now() - req->sent);
+		unsigned code = 0;
+		if (dataLen >= 4)
+			AdsCodec::decode(req->data.ptr(), 1, &code);
+		if (code != 0)
+			_metrics.error(code);
 	}
+	finish(req);
+	return ok && skipBytes(bodyLen - dataLen);
+}
+
+bool BeckhoffAds::hasError() const
+{
+	return _adsError != 0;
+}
+
+bool BeckhoffAds::hasFatalError() const
+{
+	return _lastError != 0;
+}
+
+AdsMetrics::Snapshot BeckhoffAds::metrics()
+{
+	return _metrics.snapshot(&dispatcher()->delay());
+}
+
+ByteArray BeckhoffAds::getResponse(Request& req)
+{
+	req.done.wait();
+
+	// the last error is only set by the thread that sent the request
 
-	return ByteArray();
+	_adsError = req.error;
+	if (req.error != 0)
+		return ByteArray();
+	if (req.timedOut)
+		_lastError = -3;
+	if (!req.received)
+		return ByteArray();
+	return req.data;
 }
 
 bool BeckhoffAds::write(unsigned group, unsigned offset, const ByteArray& data)
 {
+	int error;
+	return write(group, offset, data, error);
+}
+
+bool BeckhoffAds::write(unsigned group, unsigned offset, const ByteArray& data, int& error)
+{
+	error = 0;
+	if (data.length() > _maxChunk && isByteAddressed(group))
+	{
+		bool ok = writeBlock(group, offset, data);
+		error = ok ? 0 : -1;
+		return ok;
+	}
+
 	StreamBuffer buffer(ENDIAN_LITTLE);
 	buffer << (uint32_t)group << (uint32_t)offset << (uint32_t)data.length();
 	buffer << data;
 
-	Lock _(_cmdMutex);
+	Request req;
 
-	if (!send(ADSCOM_WRITE, buffer))
+	if (!send(ADSCOM_WRITE, buffer, req))
+	{
+		error = -1;
 		return false;
+	}
 
-	ByteArray response = getResponse();
+	ByteArray response = getResponse(req);
 
 	if (!response)
 	{
+		error = req.error ? req.error : -1;
 		return false;
 	}
 
 	StreamBufferReader reader(response);
-	uint32_t           error;
-	reader >> error;
-	if (error != 0)
+	uint32_t           code;
+	reader >> code;
+	if (code != 0)
 	{
-		printf("ADS: write error (%u) %s\n", error, *adsErrors[error]);
+		ADS_LOG(ERROR, "write error (%u) %s", code, *adsErrors[code]);
+		_adsError = error = code;
 		return false;
 	}
 	return true;
@@ -439,58 +1014,505 @@ bool BeckhoffAds::write(unsigned group, unsigned offset, const ByteArray& data)
 
 ByteArray BeckhoffAds::read(unsigned group, unsigned offset, int length)
 {
+	int error;
+	return read(group, offset, length, error);
+}
+
+ByteArray BeckhoffAds::read(unsigned group, unsigned offset, int length, int& error)
+{
+	error = 0;
+	if (length > _maxChunk && isByteAddressed(group))
+	{
+		ByteArray data = readBlock(group, offset, length);
+		error = !data ? -1 : 0;
+		return data;
+	}
+
 	StreamBuffer buffer(ENDIAN_LITTLE);
 	buffer << (uint32_t)group << (uint32_t)offset << (uint32_t)length;
 
-	Lock _(_cmdMutex);
+	Request req;
 
-	if (!send(ADSCOM_READ, buffer))
+	if (!send(ADSCOM_READ, buffer, req))
+	{
+		error = -1;
 		return ByteArray();
-	ByteArray response = getResponse();
+	}
+	ByteArray response = getResponse(req);
 	if (!response)
 	{
+		error = req.error ? req.error : -1;
 		return ByteArray();
 	}
 	StreamBufferReader reader(response);
-	uint32_t           error, len;
-	reader >> error >> len;
-	if (error != 0 || len > 60000)
+	uint32_t           code, len;
+	reader >> code >> len;
+	if (code != 0 || int(len) > length || int(len) > reader.length())
 	{
-		printf("ADS: read error (%u) %s\n", error, *adsErrors[error]);
-		_adsError = error;
+		ADS_LOG(ERROR, "read error (%u) %s", code, *adsErrors[code]);
+		_adsError = code;
+		error = code ? code : -1;
 		return ByteArray();
 	}
 	return reader.read(len);
 }
 
+ByteArray BeckhoffAds::readBlock(unsigned group, unsigned offset, int length)
+{
+	int             n = (length + _maxChunk - 1) / _maxChunk;
+	int             sent = 0;
+	bool            ok = true;
+	ByteArray       data(length);
+	Array<Request*> requests(n);
+
+	// keep up to ADS_BLOCK_WINDOW chunk requests in flight, consume responses in order
+
+	for (int i = 0; i < n; i++)
+	{
+		while (ok && sent < n && sent - i < ADS_BLOCK_WINDOW)
+		{
+			StreamBuffer buffer(ENDIAN_LITTLE);
+			int          size = min(_maxChunk, length - sent * _maxChunk);
+			buffer << (uint32_t)group << uint32_t(offset + sent * _maxChunk) << (uint32_t)size;
+			requests[sent] = new Request;
+			if (!send(ADSCOM_READ, buffer, *requests[sent]))
+			{
+				delete requests[sent];
+				ok = false;
+				break;
+			}
+			sent++;
+		}
+		if (i >= sent)
+			break;
+
+		ByteArray response = getResponse(*requests[i]);
+		delete requests[i];
+		if (!ok || !response)
+		{
+			ok = false;
+			continue;
+		}
+		StreamBufferReader reader(response);
+		uint32_t           error, len;
+		reader >> error >> len;
+		int size = min(_maxChunk, length - i * _maxChunk);
+		if (error != 0 || int(len) != size || reader.length() < size)
+		{
+			ADS_LOG(ERROR, "block read error at %u (%u) %s", offset + i * _maxChunk, error, *adsErrors[error]);
+			_adsError = error;
+			ok = false;
+			continue;
+		}
+		memcpy(data.ptr() + i * _maxChunk, reader.ptr(), size);
+	}
+	return ok ? data : ByteArray();
+}
+
+bool BeckhoffAds::writeBlock(unsigned group, unsigned offset, const ByteArray& data)
+{
+	int             length = data.length();
+	int             n = (length + _maxChunk - 1) / _maxChunk;
+	int             sent = 0;
+	bool            ok = true;
+	Array<Request*> requests(n);
+
+	for (int i = 0; i < n; i++)
+	{
+		while (ok && sent < n && sent - i < ADS_BLOCK_WINDOW)
+		{
+			StreamBuffer buffer(ENDIAN_LITTLE);
+			int          size = min(_maxChunk, length - sent * _maxChunk);
+			buffer << (uint32_t)group << uint32_t(offset + sent * _maxChunk) << (uint32_t)size;
+			buffer << ByteArray(data.ptr() + sent * _maxChunk, size);
+			requests[sent] = new Request;
+			if (!send(ADSCOM_WRITE, buffer, *requests[sent]))
+			{
+				delete requests[sent];
+				ok = false;
+				break;
+			}
+			sent++;
+		}
+		if (i >= sent)
+			break;
+
+		ByteArray response = getResponse(*requests[i]);
+		delete requests[i];
+		uint32_t error = response.length() >= 4 ? StreamBufferReader(response).read<uint32_t>() : 0;
+		if (!response || error != 0)
+		{
+			ADS_LOG(ERROR, "block write error at %u (%u) %s", offset + i * _maxChunk, error, *adsErrors[error]);
+			if (error)
+				_adsError = error;
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+BeckhoffAds::PreparedRequest BeckhoffAds::prepareRead(unsigned group, unsigned offset, int length)
+{
+	StreamBuffer buffer(ENDIAN_LITTLE);
+	buffer << (uint32_t)group << (uint32_t)offset << (uint32_t)length;
+
+	PreparedRequest req;
+	req.command = ADSCOM_READ;
+	req.length = length;
+	req.frame = encodeFrame(ADSCOM_READ, *buffer);
+	req.dataOffset = req.frame.length();
+	return req;
+}
+
+BeckhoffAds::PreparedRequest BeckhoffAds::prepareRead(const Handle& handle, int length)
+{
+	return prepareRead(ADSIGRP_VALBYHND, handle.h, length);
+}
+
+BeckhoffAds::PreparedRequest BeckhoffAds::prepareWrite(unsigned group, unsigned offset, int size)
+{
+	StreamBuffer buffer(ENDIAN_LITTLE);
+	buffer << (uint32_t)group << (uint32_t)offset << (uint32_t)size;
+	buffer << ByteArray(size, 0);
+
+	PreparedRequest req;
+	req.command = ADSCOM_WRITE;
+	req.frame = encodeFrame(ADSCOM_WRITE, *buffer);
+	req.dataSize = size;
+	req.dataOffset = req.frame.length() - size;
+	return req;
+}
+
+BeckhoffAds::PreparedRequest BeckhoffAds::prepareWrite(const Handle& handle, int size)
+{
+	return prepareWrite(ADSIGRP_VALBYHND, handle.h, size);
+}
+
+BeckhoffAds::PreparedRequest BeckhoffAds::prepareReadWrite(unsigned group, unsigned offset, int length,
+                                                           const ByteArray& data)
+{
+	StreamBuffer buffer(ENDIAN_LITTLE);
+	buffer << (uint32_t)group << (uint32_t)offset << (uint32_t)length << (uint32_t)data.length();
+	buffer << data;
+
+	PreparedRequest req;
+	req.command = ADSCOM_READWRITE;
+	req.length = length;
+	req.frame = encodeFrame(ADSCOM_READWRITE, *buffer);
+	req.dataSize = data.length();
+	req.dataOffset = req.frame.length() - data.length();
+	return req;
+}
+
+Array<BeckhoffAds::PreparedRequest> BeckhoffAds::prepareSumRead(const Array<Handle>& handles, const Array<int>& sizes)
+{
+	Array<PreparedRequest> requests;
+
+	for (int i0 = 0, i1 = 0; i0 < handles.length(); i0 = i1)
+	{
+		StreamBuffer request(ENDIAN_LITTLE);
+		int          length = 0;
+		for (i1 = i0; i1 < handles.length() && i1 - i0 < ADS_MAX_SUM_ITEMS; i1++)
+		{
+			if (i1 > i0 && length + 4 + sizes[i1] > _maxChunk)
+				break;
+			request << (uint32_t)ADSIGRP_VALBYHND << (uint32_t)handles[i1].h << (uint32_t)sizes[i1];
+			length += 4 + sizes[i1];
+		}
+		PreparedRequest req = prepareReadWrite(ADSIGRP_SUMUP_READ, i1 - i0, length, *request);
+		req.items = i1 - i0;
+		requests << req;
+	}
+	return requests;
+}
+
+Array<BeckhoffAds::PreparedRequest> BeckhoffAds::prepareSumWrite(const Array<Handle>& handles, const Array<int>& sizes)
+{
+	Array<PreparedRequest> requests;
+
+	for (int i0 = 0, i1 = 0; i0 < handles.length(); i0 = i1)
+	{
+		int size = 0;
+		for (i1 = i0; i1 < handles.length() && i1 - i0 < ADS_MAX_SUM_ITEMS; i1++)
+		{
+			if (i1 > i0 && size + 12 + sizes[i1] > _maxChunk)
+				break;
+			size += 12 + sizes[i1];
+		}
+
+		// item headers first, then room for the values
+
+		StreamBuffer request(ENDIAN_LITTLE);
+		for (int i = i0; i < i1; i++)
+			request << (uint32_t)ADSIGRP_VALBYHND << (uint32_t)handles[i].h << (uint32_t)sizes[i];
+		int headers = request.length();
+		request << ByteArray(size - headers, 0);
+
+		PreparedRequest req = prepareReadWrite(ADSIGRP_SUMUP_WRITE, i1 - i0, 4 * (i1 - i0), *request);
+		req.items = i1 - i0;
+		req.dataOffset += headers;
+		req.dataSize -= headers;
+		requests << req;
+	}
+	return requests;
+}
+
+bool BeckhoffAds::execute(PreparedRequest& prepared, ByteArray* data)
+{
+	Request req;
+
+	if (!prepared || !sendFrame(prepared.frame, req))
+		return false;
+
+	ByteArray response = getResponse(req);
+
+	if (!response)
+		return false;
+
+	StreamBufferReader reader(response);
+	uint32_t           error, len;
+	reader >> error;
+	if (error != 0)
+	{
+		ADS_LOG(ERROR, "request error (%u) %s", error, *adsErrors[error]);
+		_adsError = error;
+		return false;
+	}
+	if (prepared.command == ADSCOM_WRITE)
+		return true;
+
+	if (reader.length() < 4)
+		return false;
+	reader >> len;
+	if (int(len) > prepared.length || int(len) > reader.length())
+	{
+		ADS_LOG(ERROR, "invalid response length %u", len);
+		return false;
+	}
+	if (data)
+	{
+		data->resize(len);
+		memcpy(data->ptr(), reader.ptr(), len);
+	}
+	return true;
+}
+
 ByteArray BeckhoffAds::readWrite(unsigned group, unsigned offset, int length, const ByteArray& data)
+{
+	int error;
+	return readWrite(group, offset, length, data, error);
+}
+
+ByteArray BeckhoffAds::readWrite(unsigned group, unsigned offset, int length, const ByteArray& data, int& error)
 {
 	StreamBuffer buffer(ENDIAN_LITTLE);
 	buffer << (uint32_t)group << (uint32_t)offset << (uint32_t)length << (uint32_t)data.length();
 	buffer << data;
 
-	Lock _(_cmdMutex);
+	Request req;
 
-	if (!send(ADSCOM_READWRITE, buffer))
+	error = -1;
+	if (!send(ADSCOM_READWRITE, buffer, req))
 		return ByteArray();
 
-	ByteArray response = getResponse();
+	ByteArray response = getResponse(req);
 
 	if (!response)
+	{
+		error = req.error ? req.error : -1;
 		return ByteArray();
+	}
 
 	StreamBufferReader reader(response);
-	uint32_t           error, len;
-	reader >> error >> len;
-	if (error != 0 || len > 1000)
+	uint32_t           code, len;
+	reader >> code >> len;
+	if (code != 0 || int(len) > length || int(len) > reader.length())
 	{
-		printf("ADS: readWrite error (%u) %s\n", error, *adsErrors[error]);
-		_adsError = error;
+		ADS_LOG(ERROR, "readWrite error (%u) %s", code, *adsErrors[code]);
+		_adsError = code;
+		error = code ? code : -1;
 		return ByteArray();
 	}
+	error = 0;
 	return reader.read(len);
 }
 
+Array<BeckhoffAds::Result> BeckhoffAds::sumRead(const Array<ReadItem>& items)
+{
+	Array<Result> results(items.length());
+
+	// split in chunks that fit the item and frame limits, each chunk is one ADS request
+
+	for (int i0 = 0, i1 = 0; i0 < items.length(); i0 = i1)
+	{
+		StreamBuffer request(ENDIAN_LITTLE);
+		int          length = 0;
+		for (i1 = i0; i1 < items.length() && i1 - i0 < ADS_MAX_SUM_ITEMS; i1++)
+		{
+			if (i1 > i0 && length + 4 + items[i1].length > _maxChunk)
+				break;
+			request << (uint32_t)items[i1].group << (uint32_t)items[i1].offset << (uint32_t)items[i1].length;
+			length += 4 + items[i1].length;
+		}
+
+		int       n = i1 - i0, error = 0;
+		ByteArray response = readWrite(ADSIGRP_SUMUP_READ, n, length, request, error);
+
+		if (response.length() < 4 * n)
+		{
+			for (int i = i0; i < i1; i++)
+				results[i].error = error ? error : -1;
+			continue;
+		}
+
+		// all error codes come first, then the data of each item with its requested length
+
+		StreamBufferReader reader(response);
+		for (int i = i0; i < i1; i++)
+			results[i].error = reader.read<uint32_t>();
+
+		for (int i = i0; i < i1; i++)
+		{
+			if (reader.length() < items[i].length)
+			{
+				results[i].error = results[i].error ? results[i].error : -1;
+				continue;
+			}
+			if (results[i].error == 0)
+				results[i].data = reader.read(items[i].length);
+			else
+				reader.skip(items[i].length);
+		}
+	}
+	return results;
+}
+
+Array<BeckhoffAds::Result> BeckhoffAds::sumRead(const Array<Handle>& handles, const Array<int>& sizes)
+{
+	Array<ReadItem> items;
+	for (int i = 0; i < handles.length(); i++)
+		items << ReadItem(ADSIGRP_VALBYHND, handles[i].h, sizes[i]);
+	return sumRead(items);
+}
+
+Array<BeckhoffAds::Result> BeckhoffAds::sumRead(const Array<Handle>& handles, int size)
+{
+	return sumRead(handles, Array<int>(handles.length(), size));
+}
+
+Array<int> BeckhoffAds::sumWrite(const Array<WriteItem>& items)
+{
+	Array<int> results(items.length());
+
+	// split in chunks that fit the item and frame limits, each chunk is one ADS request
+
+	for (int i0 = 0, i1 = 0; i0 < items.length(); i0 = i1)
+	{
+		int length = 0;
+		for (i1 = i0; i1 < items.length() && i1 - i0 < ADS_MAX_SUM_ITEMS; i1++)
+		{
+			int size = 12 + items[i1].data.length();
+			if (i1 > i0 && length + size > _maxChunk)
+				break;
+			length += size;
+		}
+
+		int          n = i1 - i0;
+		StreamBuffer request(ENDIAN_LITTLE);
+
+		// all item headers first, then the data of each item
+
+		for (int i = i0; i < i1; i++)
+			request << (uint32_t)items[i].group << (uint32_t)items[i].offset << (uint32_t)items[i].data.length();
+		for (int i = i0; i < i1; i++)
+			request << items[i].data;
+
+		int       error = 0;
+		ByteArray response = readWrite(ADSIGRP_SUMUP_WRITE, n, 4 * n, request, error);
+
+		if (response.length() < 4 * n)
+		{
+			for (int i = i0; i < i1; i++)
+				results[i] = error ? error : -1;
+			continue;
+		}
+
+		StreamBufferReader reader(response);
+		for (int i = i0; i < i1; i++)
+		{
+			results[i] = reader.read<uint32_t>();
+			if (results[i] != 0)
+				ADS_LOG(ERROR, "sum write error in item %i (%i) %s", i, results[i], *adsErrors[results[i]]);
+		}
+	}
+	return results;
+}
+
+Array<int> BeckhoffAds::sumWrite(const Array<Handle>& handles, const Array<ByteArray>& values)
+{
+	Array<WriteItem> items;
+	for (int i = 0; i < handles.length(); i++)
+		items << WriteItem(ADSIGRP_VALBYHND, handles[i].h, values[i]);
+	return sumWrite(items);
+}
+
+Array<BeckhoffAds::Result> BeckhoffAds::sumReadWrite(const Array<ReadWriteItem>& items)
+{
+	Array<Result> results(items.length());
+
+	for (int i0 = 0, i1 = 0; i0 < items.length(); i0 = i1)
+	{
+		StreamBuffer request(ENDIAN_LITTLE);
+		int          length = 0;
+		for (i1 = i0; i1 < items.length() && i1 - i0 < ADS_MAX_SUM_ITEMS; i1++)
+		{
+			const ReadWriteItem& item = items[i1];
+			if (i1 > i0 && length + 8 + item.length > _maxChunk)
+				break;
+			request << (uint32_t)item.group << (uint32_t)item.offset << (uint32_t)item.length
+			        << (uint32_t)item.data.length();
+			length += 8 + item.length;
+		}
+		for (int i = i0; i < i1; i++)
+			request << items[i].data;
+
+		int       n = i1 - i0, error = 0;
+		ByteArray response = readWrite(ADSIGRP_SUMUP_READWRITE, n, length, request, error);
+
+		if (response.length() < 8 * n)
+		{
+			for (int i = i0; i < i1; i++)
+				results[i].error = error ? error : -1;
+			continue;
+		}
+
+		// error codes and returned lengths of all items come first, then the data actually returned by each
+
+		StreamBufferReader reader(response);
+		Array<int>         lengths(n);
+		for (int i = i0; i < i1; i++)
+		{
+			uint32_t error, len;
+			reader >> error >> len;
+			results[i].error = error;
+			lengths[i - i0] = len;
+		}
+
+		for (int i = i0; i < i1; i++)
+		{
+			int len = lengths[i - i0];
+			if (reader.length() < len) // truncated response, this and the following items have no data
+			{
+				for (int j = i; j < i1; j++)
+					results[j].error = results[j].error ? results[j].error : -1;
+				break;
+			}
+			results[i].data = reader.read(len);
+		}
+	}
+	return results;
+}
+
 // ADS notification times are in 100 ns units
 // https://infosys.beckhoff.com/english.php?content=../content/1033/tcadscommon/12440296075.html&id=
 // here it says unit is 1 ms ?!
@@ -502,20 +1524,74 @@ inline uint32_t toBTime(double t)
 	return uint32_t(t / 100e-9); // for 100ns
 }
 
+// adapters of the per-sample and data-only notification callbacks to the batch callback
+
+struct SampleCallback
+{
+	Function<void, const AdsSample&> f;
+	SampleCallback(const Function<void, const AdsSample&>& f) : f(f) {}
+	void operator()(const Array<AdsSample>& samples)
+	{
+		foreach (const AdsSample& sample, samples)
+			f(sample);
+	}
+};
+
+struct DataCallback
+{
+	Function<void, const ByteArray&> f;
+	DataCallback(const Function<void, const ByteArray&>& f) : f(f) {}
+	void operator()(const Array<AdsSample>& samples)
+	{
+		foreach (const AdsSample& sample, samples)
+			f(sample.bytes());
+	}
+};
+
 BeckhoffAds::Handle BeckhoffAds::addNotification(unsigned group, unsigned offset, int length, NotificationMode mode,
                                                  double maxt, double cycle, Function<void, const ByteArray&> f)
 {
-	StreamBuffer buffer(ENDIAN_LITTLE);
-	buffer << (uint32_t)group << (uint32_t)offset << (uint32_t)length;
-	buffer << (uint32_t)mode << toBTime(maxt) << toBTime(cycle);
-	buffer << (uint32_t)0 << (uint32_t)0 << (uint32_t)0 << (uint32_t)0;
+	return addBatchNotification(group, offset, length, mode, maxt, cycle, DataCallback(f));
+}
 
-	Lock _(_cmdMutex);
+BeckhoffAds::Handle BeckhoffAds::addSampleNotification(unsigned group, unsigned offset, int length,
+                                                       NotificationMode mode, double maxt, double cycle,
+                                                       Function<void, const Sample&> f)
+{
+	return addBatchNotification(group, offset, length, mode, maxt, cycle, SampleCallback(f));
+}
 
-	if (!send(ADSCOM_ADDDEVICENOTIF, buffer))
+BeckhoffAds::Handle BeckhoffAds::addSampleNotification(const asl::String& name, int length, NotificationMode mode,
+                                                       double maxt, double cycle, Function<void, const Sample&> f)
+{
+	Handle handle = variableHandle(name);
+	if (!handle)
+		return handle;
+	return addBatchNotification(ADSIGRP_VALBYHND, handle.h, length, mode, maxt, cycle, SampleCallback(f));
+}
+
+BeckhoffAds::Handle BeckhoffAds::addBatchNotification(const asl::String& name, int length, NotificationMode mode,
+                                                      double maxt, double cycle,
+                                                      Function<void, const Array<Sample>&> f)
+{
+	Handle handle = variableHandle(name);
+	if (!handle)
+		return handle;
+	return addBatchNotification(ADSIGRP_VALBYHND, handle.h, length, mode, maxt, cycle, f);
+}
+
+BeckhoffAds::Handle BeckhoffAds::addBatchNotification(unsigned group, unsigned offset, int length,
+                                                      NotificationMode mode, double maxt, double cycle,
+                                                      Function<void, const Array<Sample>&> f)
+{
+	Subscription s = { group, offset, length, mode, maxt, cycle, f, 0 };
+
+	Request req;
+
+	if (!send(ADSCOM_ADDDEVICENOTIF, encodeSubscription(s), req))
 		return 0;
 
-	ByteArray response = getResponse();
+	ByteArray response = getResponse(req);
 	if (!response)
 	{
 		return Handle();
@@ -525,16 +1601,27 @@ BeckhoffAds::Handle BeckhoffAds::addNotification(unsigned group, unsigned offset
 	reader >> error >> handle;
 	if (error != 0)
 	{
-		printf("ADS: addNotification error: (%u) %s\n", error, *adsErrors[error]);
+		ADS_LOG(ERROR, "addNotification error: (%u) %s", error, *adsErrors[error]);
 		_adsError = error;
 		return Handle();
 	}
 
+	s.handle = handle;
+	Lock _(_mutex);
 	_callbacks[handle] = f;
-	_notifications << handle;
+	_subscriptions[handle] = s;
 	return handle;
 }
 
+ByteArray BeckhoffAds::encodeSubscription(const Subscription& s)
+{
+	StreamBuffer buffer(ENDIAN_LITTLE);
+	buffer << (uint32_t)s.group << (uint32_t)s.offset << (uint32_t)s.length;
+	buffer << (uint32_t)s.mode << toBTime(s.maxt) << toBTime(s.cycle);
+	buffer << (uint32_t)0 << (uint32_t)0 << (uint32_t)0 << (uint32_t)0;
+	return *buffer;
+}
+
 BeckhoffAds::Handle BeckhoffAds::addNotification(BeckhoffAds::Handle handle, int length, NotificationMode mode,
                                                  double maxt, double cycle, Function<void, const ByteArray&> f)
 {
@@ -544,39 +1631,244 @@ BeckhoffAds::Handle BeckhoffAds::addNotification(BeckhoffAds::Handle handle, int
 BeckhoffAds::Handle BeckhoffAds::addNotification(const asl::String& name, int length, NotificationMode mode, double maxt,
                                                  double cycle, Function<void, const ByteArray&> f)
 {
-	BeckhoffAds::Handle handle = getHandle(name);
+	BeckhoffAds::Handle handle = variableHandle(name);
 	if (!handle)
 		return handle;
-	_handles << handle.h;
 	return addNotification(handle, length, mode, maxt, cycle, f);
 }
 
+BeckhoffAds::Result BeckhoffAds::result(const Request& req)
+{
+	Result r;
+	if (req.error != 0 || !req.received || req.data.length() < 4)
+	{
+		r.error = req.error != 0 ? req.error : req.timedOut ? -3 : -1;
+		return r;
+	}
+	StreamBufferReader reader(req.data);
+	r.error = reader.read<uint32_t>();
+	if (r.error != 0)
+		return r;
+	if (req.command == ADSCOM_READ || req.command == ADSCOM_READWRITE)
+	{
+		uint32_t len = reader.length() >= 4 ? reader.read<uint32_t>() : 0;
+		r.data = reader.read(min((int)len, reader.length()));
+	}
+	else
+		r.data = reader.read(reader.length());
+	return r;
+}
+
+struct BeckhoffAds::AsyncResult : public BeckhoffAds::Completion
+{
+	Function<void, const Result&> f;
+	AsyncResult(const Function<void, const Result&>& f) : f(f) {}
+	void complete(BeckhoffAds& ads, Request& req) { f(ads.result(req)); }
+};
+
+struct BeckhoffAds::AsyncHandle : public BeckhoffAds::Completion
+{
+	String                 name;
+	Function<void, Handle> f;
+	AsyncHandle(const String& name, const Function<void, Handle>& f) : name(name), f(f) {}
+	void complete(BeckhoffAds& ads, Request& req)
+	{
+		Result r = ads.result(req);
+		if (!r || r.data.length() != 4)
+		{
+			ADS_LOG(ERROR, "cannot get handle of %s", *name);
+			f(Handle());
+			return;
+		}
+		f(Handle(StreamBufferReader(r.data).read<unsigned>()));
+	}
+};
+
+struct BeckhoffAds::AsyncNotification : public BeckhoffAds::Completion
+{
+	Subscription           s;
+	Function<void, Handle> f;
+	AsyncNotification(const Subscription& s, const Function<void, Handle>& f) : s(s), f(f) {}
+	void complete(BeckhoffAds& ads, Request& req)
+	{
+		Result r = ads.result(req);
+		if (!r || r.data.length() < 4)
+		{
+			ADS_LOG(ERROR, "addNotification error: (%i)", r.error);
+			f(Handle());
+			return;
+		}
+		unsigned handle = StreamBufferReader(r.data).read<unsigned>();
+		s.handle = handle;
+		{
+			Lock _(ads._mutex);
+			ads._callbacks[handle] = s.f;
+			ads._subscriptions[handle] = s;
+		}
+		f(Handle(handle));
+	}
+};
+
+struct BeckhoffAds::AsyncRemoveNotification : public BeckhoffAds::Completion
+{
+	unsigned                      handle;
+	unsigned                      plcHandle;
+	Function<void, const Result&> f;
+	AsyncRemoveNotification(unsigned handle, unsigned plcHandle, const Function<void, const Result&>& f)
+	    : handle(handle), plcHandle(plcHandle), f(f)
+	{
+	}
+	void complete(BeckhoffAds& ads, Request& req)
+	{
+		Result r = ads.result(req);
+		if (r.error == 0)
+		{
+			Lock posting(ads._postMutex);
+			Lock _(ads._mutex);
+			ads._callbacks.remove(plcHandle);
+			ads._notifAlias.remove(plcHandle);
+			ads._subscriptions.remove(handle);
+			ads.dispatcher()->remove(dispatchKey(ads._id, handle), false); // may run on the receiving thread
+		}
+		f(r);
+	}
+};
+
+bool BeckhoffAds::sendAsync(int command, const ByteArray& data, Completion* completion)
+{
+	Request* req = new Request;
+	req->completion = completion;
+
+	// once sent, the request belongs to the receive thread
+
+	if (!send(command, data, *req))
+	{
+		delete completion;
+		delete req;
+		return false;
+	}
+	return true;
+}
+
+bool BeckhoffAds::readAsync(unsigned group, unsigned offset, int length, Function<void, const Result&> f)
+{
+	StreamBuffer buffer(ENDIAN_LITTLE);
+	buffer << (uint32_t)group << (uint32_t)offset << (uint32_t)length;
+	return sendAsync(ADSCOM_READ, buffer, new AsyncResult(f));
+}
+
+bool BeckhoffAds::writeAsync(unsigned group, unsigned offset, const ByteArray& data, Function<void, const Result&> f)
+{
+	StreamBuffer buffer(ENDIAN_LITTLE);
+	buffer << (uint32_t)group << (uint32_t)offset << (uint32_t)data.length();
+	buffer << data;
+	return sendAsync(ADSCOM_WRITE, buffer, new AsyncResult(f));
+}
+
+bool BeckhoffAds::readWriteAsync(unsigned group, unsigned offset, int length, const ByteArray& data,
+                                 Function<void, const Result&> f)
+{
+	StreamBuffer buffer(ENDIAN_LITTLE);
+	buffer << (uint32_t)group << (uint32_t)offset << (uint32_t)length << (uint32_t)data.length();
+	buffer << data;
+	return sendAsync(ADSCOM_READWRITE, buffer, new AsyncResult(f));
+}
+
+bool BeckhoffAds::readValueAsync(const String& name, int n, Function<void, const Result&> f)
+{
+	return readWriteAsync(ADSIGRP_VALBYNAME, 0, n, ByteArray((byte*)*name, name.length() + 1), f);
+}
+
+bool BeckhoffAds::readValueAsync(const Handle& handle, int n, Function<void, const Result&> f)
+{
+	return readAsync(ADSIGRP_VALBYHND, handle.h, n, f);
+}
+
+bool BeckhoffAds::writeValueAsync(const Handle& handle, const ByteArray& data, Function<void, const Result&> f)
+{
+	return writeAsync(ADSIGRP_VALBYHND, handle.h, data, f);
+}
+
+bool BeckhoffAds::getHandleAsync(const String& name, Function<void, Handle> f)
+{
+	StreamBuffer buffer(ENDIAN_LITTLE);
+	buffer << (uint32_t)ADSIGRP_HNDBYNAME << (uint32_t)0 << (uint32_t)4 << (uint32_t)(name.length() + 1);
+	buffer << ByteArray((byte*)*name, name.length() + 1);
+	return sendAsync(ADSCOM_READWRITE, buffer, new AsyncHandle(name, f));
+}
+
+bool BeckhoffAds::addNotificationAsync(unsigned group, unsigned offset, int length, NotificationMode mode, double maxt,
+                                       double cycle, Function<void, const Array<Sample>&> f,
+                                       Function<void, Handle> done)
+{
+	Subscription s = { group, offset, length, mode, maxt, cycle, f, 0 };
+	return sendAsync(ADSCOM_ADDDEVICENOTIF, encodeSubscription(s), new AsyncNotification(s, done));
+}
+
+bool BeckhoffAds::removeNotificationAsync(Handle handle, Function<void, const Result&> f)
+{
+	unsigned     h = plcHandle(handle.h);
+	StreamBuffer buffer(ENDIAN_LITTLE);
+	buffer << (uint32_t)h;
+	return sendAsync(ADSCOM_DELDEVICENOTIF, buffer, new AsyncRemoveNotification(handle.h, h, f));
+}
+
+BeckhoffAds::Handle BeckhoffAds::variableHandle(const asl::String& name)
+{
+	BeckhoffAds::Handle handle = getHandle(name);
+	if (!handle)
+		return handle;
+	Lock _(_mutex);
+	_handles[handle.h] = name;
+	return handle;
+}
+
 bool BeckhoffAds::removeNotification(BeckhoffAds::Handle handle)
 {
+	unsigned     h = plcHandle(handle.h);
 	StreamBuffer buffer(ENDIAN_LITTLE);
-	buffer << (uint32_t)handle.h;
+	buffer << (uint32_t)h;
 
-	Lock _(_cmdMutex);
+	Request   req;
+	ByteArray response;
+	bool      ok = send(ADSCOM_DELDEVICENOTIF, buffer, req);
 
-	if (!send(ADSCOM_DELDEVICENOTIF, buffer))
-		return false;
+	if (ok)
+	{
+		response = getResponse(req);
+		ok = !!response;
+	}
+	if (ok)
+	{
+		StreamBufferReader reader(response);
+		uint32_t           error;
+		reader >> error;
+		ok = error == 0;
+		if (!ok)
+			ADS_LOG(ERROR, "removeNotification error (%u) %s", error, *adsErrors[error]);
+	}
 
-	ByteArray response = getResponse();
-	if (!response)
-		return false;
+	// the callback is dropped even if the PLC could not be told, and callbacks already running are waited for (not
+	// holding the mutex, which they may need), so the callback's state can be destroyed after this returns
 
-	StreamBufferReader reader(response);
-	uint32_t           error;
-	reader >> error;
-	if (error != 0)
 	{
-		printf("ADS: removeNotification error (%u) %s\n", error, *adsErrors[error]);
-		return false;
+		Lock posting(_postMutex);
+		Lock _(_mutex);
+		_callbacks.remove(h);
+		_notifAlias.remove(h);
+		_subscriptions.remove(handle.h);
 	}
+	dispatcher()->remove(dispatchKey(_id, handle.h));
 
-	_callbacks.remove(handle.h);
+	return ok;
+}
 
-	return true;
+// returns the current PLC handle of a notification, which changes after a reconnection
+
+unsigned BeckhoffAds::plcHandle(unsigned handle)
+{
+	Lock _(_mutex);
+	return _subscriptions.has(handle) ? _subscriptions[handle].handle : handle;
 }
 
 BeckhoffAds::Handle BeckhoffAds::getHandle(const asl::String& name)
@@ -584,33 +1876,69 @@ BeckhoffAds::Handle BeckhoffAds::getHandle(const asl::String& name)
 	ByteArray response = readWrite(ADSIGRP_HNDBYNAME, 0, 4, ByteArray((byte*)*name, name.length() + 1));
 	if (response.length() != 4)
 	{
-		printf("ADS: cannot get handle of %s\n", *name);
+		ADS_LOG(ERROR, "cannot get handle of %s", *name);
 		return Handle();
 	}
 	return StreamBufferReader(response).read<unsigned>();
 }
 
+Array<BeckhoffAds::Handle> BeckhoffAds::getHandles(const Array<String>& names)
+{
+	Array<ReadWriteItem> items;
+	foreach (const String& name, names)
+		items << ReadWriteItem(ADSIGRP_HNDBYNAME, 0, 4, ByteArray((byte*)*name, name.length() + 1));
+
+	Array<Result> results = sumReadWrite(items);
+	Array<Handle> handles(names.length());
+
+	for (int i = 0; i < results.length(); i++)
+	{
+		if (!results[i] || results[i].data.length() != 4)
+		{
+			ADS_LOG(ERROR, "cannot get handle of %s (%i) %s", *names[i], results[i].error, *adsErrors[results[i].error]);
+			continue;
+		}
+		handles[i] = StreamBufferReader(results[i].data).read<unsigned>();
+	}
+	return handles;
+}
+
+void BeckhoffAds::releaseHandles(const Array<Handle>& handles)
+{
+	Array<WriteItem> items;
+	foreach (const Handle& handle, handles)
+	{
+		if (!handle)
+			continue;
+		StreamBuffer buffer(ENDIAN_LITTLE);
+		buffer << (uint32_t)handle.h;
+		items << WriteItem(ADSIGRP_RELEASEHND, 0, buffer);
+	}
+	if (items.length() > 0)
+		sumWrite(items);
+}
+
 void BeckhoffAds::releaseHandle(BeckhoffAds::Handle handle)
 {
 	StreamBuffer buffer(ENDIAN_LITTLE);
 	buffer << (uint32_t)handle.h;
 	if (!write(ADSIGRP_RELEASEHND, 0, buffer))
 	{
-		printf("ADS: cannot release handle %u\n", handle.h);
+		ADS_LOG(ERROR, "cannot release handle %u", handle.h);
 	}
 }
 
 BeckhoffAds::State BeckhoffAds::getState()
 {
-	Lock _(_cmdMutex);
+	Request req;
 
 	BeckhoffAds::State state = { 0, 0, true };
-	if (!send(ADSCOM_READSTATE, ByteArray()))
+	if (!send(ADSCOM_READSTATE, ByteArray(), req))
 		return state;
-	ByteArray response = getResponse();
+	ByteArray response = getResponse(req);
 	if (!response)
 	{
-		printf("ADS: Cannot read state\n");
+		ADS_LOG(ERROR, "Cannot read state");
 		return state;
 	}
 	StreamBufferReader reader(response);
@@ -619,7 +1947,7 @@ BeckhoffAds::State BeckhoffAds::getState()
 	reader >> error >> stat >> devstate;
 	if (error != 0)
 	{
-		printf("ADS: getState error %u\n", error);
+		ADS_LOG(ERROR, "getState error %u", error);
 		return state;
 	}
 
@@ -632,14 +1960,14 @@ BeckhoffAds::State BeckhoffAds::getState()
 BeckhoffAds::DevInfo BeckhoffAds::getInfo()
 {
 	DevInfo info = { 0, 0, 0 };
-	Lock    _(_cmdMutex);
+	Request req;
 
-	if (!send(ADSCOM_READDEVICEINFO, ByteArray()))
+	if (!send(ADSCOM_READDEVICEINFO, ByteArray(), req))
 		return info;
-	ByteArray response = getResponse();
+	ByteArray response = getResponse(req);
 	if (!response || response.length() != 24)
 	{
-		printf("ADS: Cannot read device info\n");
+		ADS_LOG(ERROR, "Cannot read device info");
 		return info;
 	}
 	StreamBufferReader reader(response);
@@ -650,7 +1978,7 @@ BeckhoffAds::DevInfo BeckhoffAds::getInfo()
 	ByteArray name = reader.read(16);
 	if (error != 0)
 	{
-		printf("ADS: getInfo error %u\n", error);
+		ADS_LOG(ERROR, "getInfo error %u", error);
 		return info;
 	}
 
@@ -674,17 +2002,60 @@ Array<BeckhoffAds::SymInfo> BeckhoffAds::getSymbols()
 	uint32_t           syms, size;
 	reader >> syms >> size;
 
+	// with a cache directory, the table is reused while the symbol version and upload info are unchanged
+
+	String cacheFile;
+	int    version = -1;
+
+	if (_symbolCacheDir.ok())
+	{
+		ByteArray v = read(ADSIGRP_VERSION, 0, 1);
+		if (v.length() == 1)
+		{
+			version = v[0];
+			cacheFile = String::f("%s/ads-%s-%i.symbols", *_symbolCacheDir, *_target.toString(), _targetPort);
+			if (loadSymbols(cacheFile, version, syms, size, info))
+				return info;
+		}
+	}
+
 	data = read(ADSIGRP_SYM_UPLOAD, 0, size);
 
 	if (data.length() < int(size))
 		return info;
 
-	reader = StreamBufferReader(data);
-	uint32_t len, group, offset, dtype, flags;
-	uint16_t namelen, typelen, comlen;
+	info = parseSymbols(data, syms);
+
+	if (version >= 0)
+		saveSymbols(cacheFile, version, syms, size, info);
+
+	return info;
+}
+
+bool BeckhoffAds::getSymbol(const String& name, SymInfo& info)
+{
+	ByteArray response = readWrite(ADSIGRP_INFOBYNAMEEX, 0, 0xFFFF, ByteArray((byte*)*name, name.length() + 1));
+	Array<SymInfo> syms = parseSymbols(response, 1);
+	if (syms.length() != 1)
+	{
+		ADS_LOG(ERROR, "cannot get symbol info of %s", *name);
+		return false;
+	}
+	info = syms[0];
+	return true;
+}
+
+Array<BeckhoffAds::SymInfo> BeckhoffAds::parseSymbols(const ByteArray& data, int syms)
+{
+	Array<BeckhoffAds::SymInfo> info;
+	StreamBufferReader          reader(data);
+	uint32_t                    len, group, offset, size, dtype, flags;
+	uint16_t                    namelen, typelen, comlen;
 
-	for (int i = 0; i < int(syms); i++)
+	for (int i = 0; i < syms; i++)
 	{
+		if (reader.length() < 30)
+			break;
 		BeckhoffAds::SymInfo sym;
 		const byte*          p = reader.ptr();
 		reader >> len >> group >> offset >> size >> dtype >> flags >> namelen >> typelen >> comlen;
@@ -694,6 +2065,9 @@ Array<BeckhoffAds::SymInfo> BeckhoffAds::getSymbols()
 		reader.skip(1);
 		String com = reader.read(comlen);
 		reader.skip(len - int(reader.ptr() - p));
+		sym.group = group;
+		sym.offset = offset;
+		sym.size = size;
 		sym.typecode = dtype;
 		sym.flags = flags;
 
@@ -703,17 +2077,159 @@ Array<BeckhoffAds::SymInfo> BeckhoffAds::getSymbols()
 	return info;
 }
 
+Array<BeckhoffAds::DataType> BeckhoffAds::getDataTypes()
+{
+	Array<DataType> types;
+
+	ByteArray data = read(ADSIGRP_SYM_UPLOADINFO2, 0, 24);
+
+	if (data.length() < 24)
+		return types;
+
+	StreamBufferReader reader(data);
+	uint32_t           syms, symSize, count, size;
+	reader >> syms >> symSize >> count >> size;
+
+	data = read(ADSIGRP_SYM_DT_UPLOAD, 0, size);
+
+	if (data.length() < int(size))
+		return types;
+
+	reader = StreamBufferReader(data);
+	for (unsigned i = 0; i < count; i++)
+	{
+		DataType type;
+		if (!parseDataType(reader, type))
+			break;
+		types << type;
+	}
+	return types;
+}
+
+// parses a data type entry, whose members are nested entries of the same form
+
+bool BeckhoffAds::parseDataType(StreamBufferReader& reader, DataType& type)
+{
+	if (reader.length() < 42)
+		return false;
+
+	const byte* p = reader.ptr();
+	uint32_t    len, version, hash, typeHash, size, offset, dtype, flags;
+	uint16_t    namelen, typelen, comlen, ndims, nfields;
+	reader >> len >> version >> hash >> typeHash >> size >> offset >> dtype >> flags;
+	reader >> namelen >> typelen >> comlen >> ndims >> nfields;
+
+	if (len < 42 || (unsigned)reader.length() + 42 < len || reader.length() < namelen + typelen + comlen + 3 + ndims * 8)
+		return false;
+
+	type.name = reader.read(namelen);
+	reader.skip(1);
+	type.type = reader.read(typelen);
+	reader.skip(1);
+	reader.skip(comlen + 1);
+	type.size = size;
+	type.offset = offset;
+	type.typecode = dtype;
+	type.flags = flags;
+
+	for (int i = 0; i < ndims; i++)
+	{
+		ArrayDim dim;
+		int      lower;
+		uint32_t elements;
+		reader >> lower >> elements;
+		dim.lower = lower;
+		dim.elements = elements;
+		type.dims << dim;
+	}
+
+	for (int i = 0; i < nfields; i++)
+	{
+		DataType field;
+		if (!parseDataType(reader, field))
+			return false;
+		type.fields << field;
+	}
+
+	int rest = len - int(reader.ptr() - p); // GUID, attributes, etc.
+	if (rest < 0 || reader.length() < rest)
+		return false;
+	reader.skip(rest);
+	return true;
+}
+
+// symbol cache file: magic, format, symbol version, upload info, then the symbols with length-prefixed strings
+
+const uint32_t SYMCACHE_MAGIC = 0x59534441; // "ADSY"
+const uint32_t SYMCACHE_FORMAT = 1;
+
+bool BeckhoffAds::loadSymbols(const String& file, int version, unsigned syms, unsigned size, Array<SymInfo>& info)
+{
+	ByteArray data = File(file).content();
+	if (data.length() < 21)
+		return false;
+
+	StreamBufferReader reader(data);
+	uint32_t           magic, format, syms0, size0, count;
+	byte               version0;
+	reader >> magic >> format >> version0 >> syms0 >> size0 >> count;
+	if (magic != SYMCACHE_MAGIC || format != SYMCACHE_FORMAT || version0 != version || syms0 != syms || size0 != size)
+		return false;
+
+	info.clear();
+	info.reserve(count);
+	for (unsigned i = 0; i < count; i++)
+	{
+		if (reader.length() < 24)
+			return false;
+		SymInfo  sym;
+		uint32_t group, offset, length, typecode, flags;
+		uint16_t namelen, typelen;
+		reader >> group >> offset >> length >> typecode >> flags >> namelen;
+		if (reader.length() < namelen + 2)
+			return false;
+		sym.name = reader.read(namelen);
+		reader >> typelen;
+		if (reader.length() < typelen)
+			return false;
+		sym.type = reader.read(typelen);
+		sym.group = group;
+		sym.offset = offset;
+		sym.size = length;
+		sym.typecode = typecode;
+		sym.flags = flags;
+		info << sym;
+	}
+	return true;
+}
+
+void BeckhoffAds::saveSymbols(const String& file, int version, unsigned syms, unsigned size, const Array<SymInfo>& info)
+{
+	StreamBuffer data(ENDIAN_LITTLE);
+	data << SYMCACHE_MAGIC << SYMCACHE_FORMAT << (byte)version << (uint32_t)syms << (uint32_t)size;
+	data << (uint32_t)info.length();
+	foreach (const SymInfo& sym, info)
+	{
+		data << (uint32_t)sym.group << (uint32_t)sym.offset << (uint32_t)sym.size << (uint32_t)sym.typecode
+		     << (uint32_t)sym.flags;
+		data << (uint16_t)sym.name.length() << ByteArray((byte*)*sym.name, sym.name.length());
+		data << (uint16_t)sym.type.length() << ByteArray((byte*)*sym.type, sym.type.length());
+	}
+	if (!File(file, File::WRITE).put(data))
+		ADS_LOG(ERROR, "cannot write symbol cache %s", *file);
+}
+
 bool BeckhoffAds::writeControl(BeckhoffAds::State state, const asl::ByteArray& data)
 {
 	StreamBuffer buffer(ENDIAN_LITTLE);
 	buffer << (uint16_t)state.state << (uint16_t)state.deviceState << (uint32_t)data.length() << data;
 
-	Lock _(_cmdMutex);
+	Request req;
 
-	if (!send(ADSCOM_WRITECTRL, buffer))
+	if (!send(ADSCOM_WRITECTRL, buffer, req))
 		return false;
 
-	ByteArray response = getResponse();
+	ByteArray response = getResponse(req);
 
 	if (!response)
 		return false;
@@ -723,18 +2239,382 @@ bool BeckhoffAds::writeControl(BeckhoffAds::State state, const asl::ByteArray& d
 	reader >> error;
 	if (error != 0)
 	{
-		printf("ADS: control error (%u) %s\n", error, *adsErrors[error]);
+		ADS_LOG(ERROR, "control error (%u) %s", error, *adsErrors[error]);
 		return false;
 	}
 	return true;
 }
 
+void BeckhoffAds::setHandleCache(bool on)
+{
+	if (on && !_useHandleCache && _connected)
+		watchSymbolVersion();
+	_useHandleCache = on;
+}
+
+void BeckhoffAds::watchSymbolVersion()
+{
+	addNotification(ADSIGRP_VERSION, 0, 1, NOTIF_CHANGE, 0, 0.1, SymVersionHandler(this));
+}
+
+void BeckhoffAds::symbolVersionChanged(const ByteArray& data)
+{
+	if (data.length() < 1)
+		return;
+	Lock _(_mutex);
+	if (_symVersion >= 0 && _symVersion != data[0])
+	{
+		foreach (Handle& h, _handleCache)
+			_staleHandles << h.h;
+		_handleCache.clear();
+	}
+	_symVersion = data[0];
+}
+
+void BeckhoffAds::setAutoReconnect(bool enable, double maxDelay)
+{
+	_autoReconnect = enable;
+	_maxReconnectDelay = max(maxDelay, 0.1);
+}
+
+void BeckhoffAds::watchState()
+{
+	addNotification(ADSIGRP_DEVICE_DATA, ADSIOFFS_DEVDATA_ADSSTATE, 2, NOTIF_CHANGE, 0, 0.1, StateHandler(this));
+}
+
+void BeckhoffAds::stateChanged(const ByteArray& data)
+{
+	if (data.length() < 2)
+		return;
+	int  state = data[0] | (data[1] << 8);
+	bool restarted = false;
+	{
+		Lock _(_mutex);
+		restarted = state == ADSSTATE_RUN && _plcState >= 0 && _plcState != ADSSTATE_RUN;
+		if (restarted)
+			_plcRestarted = true;
+		_plcState = state;
+	}
+	if (restarted)
+		_reconnectEvent.post();
+}
+
+void BeckhoffAds::connectionLost()
+{
+	if (_autoReconnect && _reconnectThread && !_stopReconnect)
+		_reconnectEvent.post();
+}
+
+void BeckhoffAds::stopReconnect()
+{
+	if (!_reconnectThread)
+		return;
+	_stopReconnect = true;
+	_reconnectEvent.post();
+	if (_reconnectThreadId == adsThreadId()) // called from an onReconnect() callback, joined on the next call
+		return;
+	_reconnectThread->join();
+	delete _reconnectThread;
+	_reconnectThread = 0;
+}
+
+// runs in its own thread, woken up when the connection is lost or the PLC is back to RUN
+
+void BeckhoffAds::reconnectLoop()
+{
+	while (1)
+	{
+		_reconnectEvent.wait();
+		if (_stopReconnect)
+			break;
+		bool lost = !_connected;
+		{
+			Lock _(_mutex);
+			if (!lost && !_plcRestarted)
+				continue;
+			_plcRestarted = false;
+		}
+		if (lost && !reopen())
+			break;
+		Array<Handle> failed = restore(!lost);
+		++_reconnections;
+		if (!!_onReconnect)
+			_onReconnect(failed);
+	}
+}
+
+// opens a lost connection again, waiting increasing times between attempts; returns false if stopped
+
+bool BeckhoffAds::reopen()
+{
+	double delay = 0.05;
+	while (!_stopReconnect)
+	{
+		closeConnection();
+		{
+			Lock _(_mutex);
+			_plcState = -1;
+		}
+		if (open())
+		{
+			ADS_LOG(INFO, "reconnected to %s", *_host);
+			return true;
+		}
+		for (double t = 0; t < delay && !_stopReconnect; t += 0.05)
+			sleep(0.05);
+		delay = min(delay * 2, _maxReconnectDelay);
+	}
+	return false;
+}
+
+// registers handles and notifications again; with `release`, as the PLC may still have the old ones, they are
+// released first. Returns the notifications that could not be restored, which are removed
+
+Array<BeckhoffAds::Handle> BeckhoffAds::restore(bool release)
+{
+	Array<String>       cacheKeys, names;
+	Array<unsigned>     oldHandles, keys;
+	Array<Handle>       old;
+	Array<Subscription> subs;
+	{
+		Lock _(_mutex);
+		foreach2 (const String& key, Handle& h, _handleCache)
+		{
+			cacheKeys << key;
+			old << h;
+		}
+		foreach2 (unsigned h, String& name, _handles)
+		{
+			oldHandles << h;
+			names << name;
+			old << h;
+		}
+		foreach (unsigned h, _staleHandles)
+			old << h;
+		foreach2 (unsigned h, Subscription& s, _subscriptions)
+		{
+			keys << h;
+			subs << s;
+		}
+		_handleCache.clear();
+		_handles.clear();
+		_staleHandles.clear();
+		_callbacks.clear();
+		_notifAlias.clear();
+	}
+
+	if (release)
+	{
+		Array<ByteArray> requests;
+		foreach (Subscription& s, subs)
+		{
+			StreamBuffer buffer(ENDIAN_LITTLE);
+			buffer << (uint32_t)s.handle;
+			requests << *buffer;
+		}
+		sendAll(ADSCOM_DELDEVICENOTIF, requests);
+		releaseHandles(old);
+	}
+
+	// resolve names in bulk, then notifications of variables by handle use the new handles
+
+	Array<Handle>           cached = cacheKeys.length() > 0 ? getHandles(cacheKeys) : Array<Handle>();
+	Array<Handle>           handles = names.length() > 0 ? getHandles(names) : Array<Handle>();
+	Map<unsigned, unsigned> moved;
+	for (int i = 0; i < handles.length(); i++)
+		if (handles[i].ok)
+			moved[oldHandles[i]] = handles[i].h;
+
+	// notifications on other variable handles (from getHandle() or not resolved again) are not restored, as the PLC
+	// may have given those handle numbers to other variables
+
+	Array<ByteArray> requests;
+	Array<bool>      restorable(subs.length());
+	for (int i = 0; i < subs.length(); i++)
+	{
+		Subscription& s = subs[i];
+		restorable[i] = s.group != ADSIGRP_VALBYHND || moved.has(s.offset);
+		if (!restorable[i])
+			continue;
+		if (s.group == ADSIGRP_VALBYHND)
+			s.offset = moved[s.offset];
+		requests << encodeSubscription(s);
+	}
+	Array<Result> results = sendAll(ADSCOM_ADDDEVICENOTIF, requests);
+	Array<Handle> lost;
+
+	{
+		Lock _(_mutex);
+		for (int i = 0; i < cached.length(); i++)
+			if (cached[i].ok)
+				_handleCache[cacheKeys[i]] = cached[i];
+		for (int i = 0; i < handles.length(); i++)
+			if (handles[i].ok)
+				_handles[handles[i].h] = names[i];
+
+		for (int i = 0, j = 0; i < subs.length(); i++)
+		{
+			const Result* r = restorable[i] ? &results[j++] : 0;
+			if (!_subscriptions.has(keys[i])) // removed meanwhile
+				continue;
+			if (!r || !*r || r->data.length() < 4)
+			{
+				ADS_LOG(ERROR, "cannot restore notification %u (%i)", keys[i], r ? r->error : ADSERR_INVALID_HANDLE);
+				_subscriptions.remove(keys[i]);
+				lost << Handle(keys[i]);
+				continue;
+			}
+			Subscription& s = _subscriptions[keys[i]];
+			s.offset = subs[i].offset;
+			s.handle = StreamBufferReader(r->data).read<unsigned>();
+			_callbacks[s.handle] = s.f;
+			if (s.handle != keys[i])
+				_notifAlias[s.handle] = keys[i];
+		}
+	}
+
+	foreach (Handle& h, lost)
+		dispatcher()->remove(dispatchKey(_id, h.h));
+	return lost;
+}
+
+// sends requests keeping up to ADS_BLOCK_WINDOW in flight, and returns their results in order
+
+Array<BeckhoffAds::Result> BeckhoffAds::sendAll(int command, const Array<ByteArray>& data)
+{
+	int             n = data.length(), sent = 0;
+	bool            ok = true;
+	Array<Result>   results(n);
+	Array<Request*> requests(n);
+
+	for (int i = 0; i < n; i++)
+	{
+		while (ok && sent < n && sent - i < ADS_BLOCK_WINDOW)
+		{
+			requests[sent] = new Request;
+			if (!send(command, data[sent], *requests[sent]))
+			{
+				delete requests[sent];
+				ok = false;
+				break;
+			}
+			sent++;
+		}
+		if (i >= sent)
+		{
+			results[i].error = -1;
+			continue;
+		}
+		requests[i]->done.wait();
+		results[i] = result(*requests[i]);
+		delete requests[i];
+	}
+	return results;
+}
+
+BeckhoffAds::Handle BeckhoffAds::cachedHandle(const String& name)
+{
+	String key = name.toLowerCase();
+	{
+		Lock _(_mutex);
+		if (_handleCache.has(key))
+			return _handleCache[key];
+	}
+
+	Handle handle = getHandle(name);
+	if (!handle)
+		return handle;
+
+	Lock _(_mutex);
+	if (_handleCache.has(key)) // another thread got it first
+	{
+		_staleHandles << handle.h;
+		return _handleCache[key];
+	}
+	_handleCache[key] = handle;
+	return handle;
+}
+
+void BeckhoffAds::invalidateHandle(const String& name)
+{
+	String key = name.toLowerCase();
+	Lock   _(_mutex);
+	if (!_handleCache.has(key))
+		return;
+	_staleHandles << _handleCache[key].h;
+	_handleCache.remove(key);
+}
+
+void BeckhoffAds::releaseStaleHandles(int minCount)
+{
+	Array<Handle> handles;
+	{
+		Lock _(_mutex);
+		if (_staleHandles.length() < minCount)
+			return;
+		foreach (unsigned h, _staleHandles)
+			handles << h;
+		_staleHandles.clear();
+	}
+	releaseHandles(handles);
+}
+
+bool BeckhoffAds::writeValue(const asl::String& name, const asl::ByteArray& data)
+{
+	if (!_useHandleCache)
+	{
+		// release in batches instead of leaving one handle per write in the PLC
+		Handle h = getHandle(name);
+		if (!h)
+			return false;
+		bool ok = writeValue(h, data);
+		{
+			Lock _(_mutex);
+			_staleHandles << h.h;
+		}
+		releaseStaleHandles(64);
+		return ok;
+	}
+
+	for (int i = 0; i < 2; i++)
+	{
+		Handle h = cachedHandle(name);
+		if (!h)
+			return false;
+		int error = 0;
+		if (write(ADSIGRP_VALBYHND, h.h, data, error))
+			return true;
+		if (error != ADSERR_INVALID_HANDLE)
+			break;
+		invalidateHandle(name);
+	}
+	return false;
+}
+
 ByteArray BeckhoffAds::readValue(const asl::String& name, int n, bool exact)
 {
+	if (_useHandleCache)
+	{
+		for (int i = 0; i < 2; i++)
+		{
+			Handle h = cachedHandle(name);
+			if (!h)
+				return ByteArray();
+			int       error = 0;
+			ByteArray response = readValue(h, n, exact, error);
+			if (!response && error == ADSERR_INVALID_HANDLE && i == 0)
+			{
+				invalidateHandle(name);
+				continue;
+			}
+			return response;
+		}
+	}
+
 	ByteArray response = readWrite(ADSIGRP_VALBYNAME, 0, n, ByteArray((byte*)*name, name.length() + 1));
 	if (response.length() > n || !response || exact && response.length() != n)
 	{
-		printf("ADS: error reading value of %s (%i: %s)\n", *name, _adsError, *adsErrors[_adsError]);
+		ADS_LOG(ERROR, "error reading value of %s (%i: %s)", *name, _adsError, *adsErrors[_adsError]);
 		response.clear();
 	}
 	return response;
@@ -742,15 +2622,37 @@ ByteArray BeckhoffAds::readValue(const asl::String& name, int n, bool exact)
 
 ByteArray BeckhoffAds::readValue(BeckhoffAds::Handle handle, int n, bool exact)
 {
-	ByteArray response = read(ADSIGRP_VALBYHND, handle.h, n);
+	int error;
+	return readValue(handle, n, exact, error);
+}
+
+ByteArray BeckhoffAds::readValue(BeckhoffAds::Handle handle, int n, bool exact, int& error)
+{
+	ByteArray response = read(ADSIGRP_VALBYHND, handle.h, n, error);
 	if (response.length() > n || exact && response.length() != n)
 	{
-		printf("ADS: cannot read value by handle\n");
+		ADS_LOG(ERROR, "cannot read value by handle");
+		response.clear();
+	}
+	return response;
+}
+
+ByteArray BeckhoffAds::readValue(const BeckhoffAds::SymInfo& symbol, int n, bool exact)
+{
+	ByteArray response = read(symbol.group, symbol.offset, n);
+	if (response.length() > n || !response || (exact && response.length() != n))
+	{
+		ADS_LOG(ERROR, "error reading value of %s (%i: %s)", *symbol.name, _adsError, *adsErrors[_adsError]);
 		response.clear();
 	}
 	return response;
 }
 
+bool BeckhoffAds::writeValue(const BeckhoffAds::SymInfo& symbol, const asl::ByteArray& data)
+{
+	return write(symbol.group, symbol.offset, data);
+}
+
 bool BeckhoffAds::writeValue(const BeckhoffAds::Handle& handle, const asl::ByteArray& data)
 {
 	return write(ADSIGRP_VALBYHND, handle.h, data);
@@ -9,8 +9,15 @@
 #include <asl/StreamBuffer.h>
 #include <asl/Map.h>
 #include <asl/util.h>
+#include "AdsDispatcher.h"
+#include "AdsCodec.h"
+#include "AdsLog.h"
 
 struct BeckhoffThread;
+struct BeckhoffReconnectThread;
+struct SymVersionHandler;
+struct StateHandler;
+class AdsReactor;
 
 /**
  * An interface to Beckhoff PLC or TwinCAT software using the AMS/ADS protocol over TCP/IP.
@@ -18,6 +25,10 @@ struct BeckhoffThread;
 class BeckhoffAds
 {
 	friend BeckhoffThread;
+	friend BeckhoffReconnectThread;
+	friend SymVersionHandler;
+	friend StateHandler;
+	friend AdsReactor;
 
 public:
 	struct State
@@ -39,6 +50,53 @@ public:
 		asl::String type;
 		int         typecode;
 		unsigned    flags;
+		unsigned    group;
+		unsigned    offset;
+		int         size;
+	};
+
+	/**
+	 * Basic ADS data type codes, as found in `SymInfo::typecode` and `DataType::typecode`
+	 */
+	enum TypeCode
+	{
+		ADST_VOID = 0,
+		ADST_INT16 = 2,
+		ADST_INT32 = 3,
+		ADST_REAL32 = 4,
+		ADST_REAL64 = 5,
+		ADST_INT8 = 16,
+		ADST_UINT8 = 17,
+		ADST_UINT16 = 18,
+		ADST_UINT32 = 19,
+		ADST_INT64 = 20,
+		ADST_UINT64 = 21,
+		ADST_STRING = 30,
+		ADST_WSTRING = 31,
+		ADST_BIT = 33,
+		ADST_BIGTYPE = 65
+	};
+
+	struct ArrayDim
+	{
+		int lower;
+		int elements;
+	};
+
+	/**
+	 * A PLC data type, or a member of a struct type (then `name` is the member name, `type` its type name and
+	 * `offset` its byte offset in the struct)
+	 */
+	struct DataType
+	{
+		asl::String          name;
+		asl::String          type;
+		int                  size;
+		unsigned             offset;
+		int                  typecode;
+		unsigned             flags;
+		asl::Array<ArrayDim> dims;
+		asl::Array<DataType> fields;
 	};
 
 	struct Handle
@@ -62,6 +120,113 @@ public:
 		asl::String toString() const;
 	};
 
+	/**
+	 * An item of a sum read: index group, offset and byte length
+	 */
+	struct ReadItem
+	{
+		unsigned group;
+		unsigned offset;
+		int      length;
+		ReadItem() : group(0), offset(0), length(0) {}
+		ReadItem(unsigned g, unsigned o, int n) : group(g), offset(o), length(n) {}
+	};
+
+	/**
+	 * An item of a sum write: index group, offset and data to write
+	 */
+	struct WriteItem
+	{
+		unsigned       group;
+		unsigned       offset;
+		asl::ByteArray data;
+		WriteItem() : group(0), offset(0) {}
+		WriteItem(unsigned g, unsigned o, const asl::ByteArray& d) : group(g), offset(o), data(d) {}
+	};
+
+	/**
+	 * An item of a sum read-write: index group, offset, maximum byte length to read and data to write
+	 */
+	struct ReadWriteItem
+	{
+		unsigned       group;
+		unsigned       offset;
+		int            length;
+		asl::ByteArray data;
+		ReadWriteItem() : group(0), offset(0), length(0) {}
+		ReadWriteItem(unsigned g, unsigned o, int n, const asl::ByteArray& d) : group(g), offset(o), length(n), data(d) {}
+	};
+
+	/**
+	 * A set of variable writes by handle to be sent together with `writeValues()`
+	 */
+	struct WriteBatch
+	{
+		asl::Array<Handle>         handles;
+		asl::Array<asl::ByteArray> values;
+
+		template<class T>
+		WriteBatch& writeValue(const Handle& h, const T& value)
+		{
+			handles << h;
+			values << *(asl::StreamBuffer() << value);
+			return *this;
+		}
+		template<class T>
+		WriteBatch& writeArray(const Handle& h, const asl::Array<T>& a)
+		{
+			asl::ByteArray data(a.length() * sizeof(T));
+			AdsCodec::encode(a.ptr(), a.length(), data.ptr());
+			handles << h;
+			values << data;
+			return *this;
+		}
+		WriteBatch& writeString(const Handle& h, const asl::String& value)
+		{
+			handles << h;
+			values << asl::ByteArray((asl::byte*)*value, value.length() + 1);
+			return *this;
+		}
+		int  length() const { return handles.length(); }
+		void clear()
+		{
+			handles.clear();
+			values.clear();
+		}
+	};
+
+	/**
+	 * The outcome of one item of a sum command: an ADS error code (0 if ok) and the data read
+	 */
+	struct Result
+	{
+		int            error;
+		asl::ByteArray data;
+		Result() : error(0) {}
+		bool operator!() const { return error != 0; }
+	};
+
+	/**
+	 * A request encoded once (header and payload) to be sent repeatedly with `execute()`, which only patches its
+	 * invokeId; for writes, the data to send is put in `data()` before each call. Prepare requests after connecting,
+	 * and do not execute the same one from several threads at once.
+	 */
+	struct PreparedRequest
+	{
+		asl::ByteArray frame;
+		int            command;
+		int            length;     // maximum length of the data read
+		int            dataOffset; // position of the data to write in the frame
+		int            dataSize;
+		int            items;      // number of sub-commands, for sum requests
+		PreparedRequest() : command(0), length(0), dataOffset(0), dataSize(0), items(0) {}
+		bool       operator!() const { return command == 0; }
+		asl::byte* data() { return frame.ptr() + dataOffset; }
+		void       setData(const asl::ByteArray& d) { memcpy(data(), d.ptr(), asl::min(d.length(), dataSize)); }
+	};
+
+	typedef AdsSample Sample;
+
 	enum NotificationMode
 	{
 		NOTIF_CYCLE = 3,
@@ -84,6 +249,27 @@ public:
 
 	bool connected() const { return _connected; }
 
+	/**
+	 * Enables reconnecting automatically (call before connect): a lost connection is opened again with increasing
+	 * delays of up to `maxDelay` seconds, and after that or when the PLC goes back to RUN, cached handles, handles of
+	 * notifications added by name and notifications are registered again. Notification handles keep their values;
+	 * handles from `getHandle()` (and variables or prepared requests using them) must be obtained again, e.g. in an
+	 * `onReconnect()` callback, and notifications added on such handles are removed, as the PLC may reuse their
+	 * numbers for other variables.
+	 */
+	void setAutoReconnect(bool enable, double maxDelay = 5.0);
+
+	/**
+	 * Sets a function to be called (from the reconnection thread) after handles and notifications were restored, with
+	 * the notifications that could not be restored and were removed; it may call `disconnect()` but not `connect()`
+	 */
+	void onReconnect(const asl::Function<void, const asl::Array<Handle>&>& f) { _onReconnect = f; }
+
+	/**
+	 * Returns the number of times the connection was restored, to detect that handles must be obtained again
+	 */
+	int reconnections() const { return _reconnections; }
+
 	/**
 	 * Sets the NetID and port of the source for communications (set before connect)
 	 */
@@ -94,6 +280,11 @@ public:
 	 */
 	void setTarget(const NetId& net, int port);
 
+	/**
+	 * Sets the TCP port of the AMS router to connect to (default 48898), e.g. for a local test server
+	 */
+	void setTcpPort(int port) { _tcpPort = port; }
+
 	/**
 	 * Gets the state of the ADS server and device
 	 */
@@ -109,6 +300,22 @@ public:
 	 */
 	asl::Array<BeckhoffAds::SymInfo> getSymbols();
 
+	/**
+	 * Gets the symbol information (type, location, size) of one variable by name, returns false if not found
+	 */
+	bool getSymbol(const asl::String& name, SymInfo& info);
+
+	/**
+	 * Sets a directory where the symbol table is cached, per target NetID and port; `getSymbols()` then loads it from
+	 * there if the PLC symbol version has not changed since it was saved
+	 */
+	void setSymbolCache(const asl::String& dir) { _symbolCacheDir = dir; }
+
+	/**
+	 * Gets the table of data types of the device, with the members of struct types (see AdsLayout)
+	 */
+	asl::Array<DataType> getDataTypes();
+
 	/**
 	 * Writes ADS and device status
 	 */
@@ -124,11 +331,163 @@ public:
 	 */
 	asl::ByteArray read(unsigned group, unsigned offset, int length);
 
+	/**
+	 * Reads a large block of data from an index group with byte offsets (like PLC memory, 0x4020) in chunks, with
+	 * several chunk requests in flight; `read()` and `write()` do this automatically for large transfers to groups
+	 * known to have byte offsets (0x4020, 0x4025, 0xF020 and 0xF030)
+	 */
+	asl::ByteArray readBlock(unsigned group, unsigned offset, int length);
+
+	/**
+	 * Writes a large block of data to an index group with byte offsets in pipelined chunks
+	 */
+	bool writeBlock(unsigned group, unsigned offset, const asl::ByteArray& data);
+
+	/**
+	 * Sets the maximum size of a received frame (larger ones are treated as a communication error, default 4 MB) and
+	 * the maximum data size of a block transfer chunk or sum request (default 65280, at most `maxFrame` - 64); returns
+	 * false if `maxFrame` is less than 128 or `maxChunk` less than 64
+	 */
+	bool setLimits(int maxFrame, int maxChunk);
+
+	/**
+	 * Sets the time in seconds to wait for a response (default 5, 0 waits forever); requests not answered in time
+	 * fail with error -3
+	 */
+	void setTimeout(double timeout) { _timeout = timeout; }
+
 	/**
 	 * Reads and writes data at a given index group and offset
 	 */
 	asl::ByteArray readWrite(unsigned group, unsigned offset, int length, const asl::ByteArray& data);
 
+	/**
+	 * Reads many group/offset/length items with ADS sum commands (one request per up to 500 items) and returns
+	 * the data and error code of each
+	 */
+	asl::Array<Result> sumRead(const asl::Array<ReadItem>& items);
+
+	/**
+	 * Reads many variables by handle in one sum request, with the byte size of each
+	 */
+	asl::Array<Result> sumRead(const asl::Array<Handle>& handles, const asl::Array<int>& sizes);
+
+	/**
+	 * Reads many variables by handle in one sum request, all with the same byte size
+	 */
+	asl::Array<Result> sumRead(const asl::Array<Handle>& handles, int size);
+
+	/**
+	 * Writes many group/offset items with ADS sum commands (one request per up to 500 items) and returns the ADS
+	 * error code of each (0 if ok)
+	 */
+	asl::Array<int> sumWrite(const asl::Array<WriteItem>& items);
+
+	/**
+	 * Writes many variables by handle in one sum request, returns the error code of each
+	 */
+	asl::Array<int> sumWrite(const asl::Array<Handle>& handles, const asl::Array<asl::ByteArray>& values);
+
+	/**
+	 * Runs many read-write items with ADS sum commands and returns the data and error code of each
+	 */
+	asl::Array<Result> sumReadWrite(const asl::Array<ReadWriteItem>& items);
+
+	/**
+	 * Prepares a read request of an index group and offset to be sent repeatedly
+	 */
+	PreparedRequest prepareRead(unsigned group, unsigned offset, int length);
+
+	/**
+	 * Prepares a read request of a variable by handle to be sent repeatedly
+	 */
+	PreparedRequest prepareRead(const Handle& handle, int length);
+
+	/**
+	 * Prepares a write request of `size` bytes to an index group and offset to be sent repeatedly
+	 */
+	PreparedRequest prepareWrite(unsigned group, unsigned offset, int size);
+
+	/**
+	 * Prepares a write request of `size` bytes to a variable by handle to be sent repeatedly
+	 */
+	PreparedRequest prepareWrite(const Handle& handle, int size);
+
+	/**
+	 * Prepares a read-write request to be sent repeatedly (like a sum read of a fixed set of variables); the write
+	 * data can be changed through `data()`
+	 */
+	PreparedRequest prepareReadWrite(unsigned group, unsigned offset, int length, const asl::ByteArray& data);
+
+	/**
+	 * Prepares sum read requests of variables by handle with the byte size of each (several requests if they do not
+	 * fit in one); the data read has the error codes of the request's items followed by their data
+	 */
+	asl::Array<PreparedRequest> prepareSumRead(const asl::Array<Handle>& handles, const asl::Array<int>& sizes);
+
+	/**
+	 * Prepares sum write requests of variables by handle with the byte size of each; the values of a request's items
+	 * are put one after the other in its `data()`
+	 */
+	asl::Array<PreparedRequest> prepareSumWrite(const asl::Array<Handle>& handles, const asl::Array<int>& sizes);
+
+	/**
+	 * Sends a prepared request and waits for its response; for reads the data read is stored in `data` if given.
+	 * Returns false on error.
+	 */
+	bool execute(PreparedRequest& request, asl::ByteArray* data = 0);
+
+	/**
+	 * Starts reading data from an index group and offset without waiting; `f` is called from the receive thread with
+	 * the result (error -1 if the connection is lost). Returns false if the request could not be sent, then `f` is not
+	 * called. Callbacks must not block nor call the waiting methods of this object, but can start other requests.
+	 */
+	bool readAsync(unsigned group, unsigned offset, int length, asl::Function<void, const Result&> f);
+
+	/**
+	 * Starts writing data to an index group and offset without waiting, `f` is called with the result
+	 */
+	bool writeAsync(unsigned group, unsigned offset, const asl::ByteArray& data, asl::Function<void, const Result&> f);
+
+	/**
+	 * Starts a read-write request without waiting, `f` is called with the result
+	 */
+	bool readWriteAsync(unsigned group, unsigned offset, int length, const asl::ByteArray& data,
+	                    asl::Function<void, const Result&> f);
+
+	/**
+	 * Starts reading a named variable without waiting, `f` is called with the result
+	 */
+	bool readValueAsync(const asl::String& name, int n, asl::Function<void, const Result&> f);
+
+	/**
+	 * Starts reading a variable by handle without waiting, `f` is called with the result
+	 */
+	bool readValueAsync(const Handle& handle, int n, asl::Function<void, const Result&> f);
+
+	/**
+	 * Starts writing a variable by handle without waiting, `f` is called with the result
+	 */
+	bool writeValueAsync(const Handle& handle, const asl::ByteArray& data, asl::Function<void, const Result&> f);
+
+	/**
+	 * Starts getting the handle of a variable without waiting, `f` is called with the handle (invalid on error)
+	 */
+	bool getHandleAsync(const asl::String& name, asl::Function<void, Handle> f);
+
+	/**
+	 * Starts adding a notification without waiting, `done` is called with the notification handle (invalid on error)
+	 * and `f` then receives the samples as in `addBatchNotification()`
+	 */
+	bool addNotificationAsync(unsigned group, unsigned offset, int length, NotificationMode mode, double maxt,
+	                          double cycle, asl::Function<void, const asl::Array<Sample>&> f,
+	                          asl::Function<void, Handle> done);
+
+	/**
+	 * Starts removing a notification without waiting, `f` is called with the result
+	 */
+	bool removeNotificationAsync(Handle handle, asl::Function<void, const Result&> f);
+
 	/**
 	 * Enables notifications for an index group and offset and returns a handle, times are in seconds
 	 */
@@ -148,7 +507,52 @@ public:
 	                       asl::Function<void, const asl::ByteArray&> f);
 
 	/**
-	 * Disables notifications for previously returned notification handle
+	 * Enables notifications for an index group and offset, with a callback that receives each sample with its PLC
+	 * timestamp; the sample data is only valid during the call
+	 */
+	Handle addSampleNotification(unsigned group, unsigned offset, int length, NotificationMode mode, double maxt,
+	                             double cycle, asl::Function<void, const Sample&> f);
+
+	/**
+	 * Enables notifications for a variable given its name, with a callback that receives each sample with its PLC
+	 * timestamp
+	 */
+	Handle addSampleNotification(const asl::String& name, int length, NotificationMode mode, double maxt, double cycle,
+	                             asl::Function<void, const Sample&> f);
+
+	/**
+	 * Enables notifications for an index group and offset, with a callback that receives all samples of this
+	 * notification that arrived in one frame, oldest first
+	 */
+	Handle addBatchNotification(unsigned group, unsigned offset, int length, NotificationMode mode, double maxt,
+	                            double cycle, asl::Function<void, const asl::Array<Sample>&> f);
+
+	/**
+	 * Enables notifications for a variable given its name, with a callback that receives all samples of this
+	 * notification that arrived in one frame, oldest first
+	 */
+	Handle addBatchNotification(const asl::String& name, int length, NotificationMode mode, double maxt, double cycle,
+	                            asl::Function<void, const asl::Array<Sample>&> f);
+
+	/**
+	 * Configures how notification callbacks are run: on a pool of `threads` worker threads (0 to run them in the
+	 * receive thread, then they must not call other methods of this object), keeping the order of samples of each
+	 * notification, with up to `depth` pending samples per notification handled as per `policy` when full. Call
+	 * before connecting; returns false (and changes nothing) while connected. The default is 2 threads, 64 samples and
+	 * DROP_OLDEST.
+	 */
+	bool setNotificationDispatch(int threads, int depth = 64, AdsDispatcher::Overflow policy = AdsDispatcher::DROP_OLDEST);
+
+	/**
+	 * Makes this connection be received by a shared reactor thread instead of its own thread (call before connect,
+	 * returns false while connected); with `sharedDispatch` its notification callbacks also run in the reactor's
+	 * dispatcher
+	 */
+	bool setReactor(AdsReactor* reactor, bool sharedDispatch = true);
+
+	/**
+	 * Disables notifications for previously returned notification handle; when it returns no callback of it is
+	 * running (unless called from that callback) or will run, even if the PLC request failed
 	 */
 	bool removeNotification(Handle handle);
 
@@ -157,11 +561,21 @@ public:
 	 */
 	Handle getHandle(const asl::String& name);
 
+	/**
+	 * Gets the handles of many variables with sum requests; handles of names not found are invalid (`!h`)
+	 */
+	asl::Array<Handle> getHandles(const asl::Array<asl::String>& names);
+
 	/**
 	 * Releases a handle
 	 */
 	void releaseHandle(Handle handle);
 
+	/**
+	 * Releases many handles with sum requests
+	 */
+	void releaseHandles(const asl::Array<Handle>& handles);
+
 	/**
 	 * Reads a variable data given a handle as data
 	 */
@@ -172,6 +586,21 @@ public:
 	 */
 	asl::ByteArray readValue(const asl::String& name, int n, bool exact = false);
 
+	/**
+	 * Reads a variable as data directly by the index group and offset of its symbol
+	 */
+	asl::ByteArray readValue(const SymInfo& symbol, int n, bool exact = false);
+
+	/**
+	 * Reads a variable as data directly by the index group and offset of its symbol, with the symbol's size
+	 */
+	asl::ByteArray readValue(const SymInfo& symbol) { return readValue(symbol, symbol.size, true); }
+
+	/**
+	 * Writes a variable as data directly by the index group and offset of its symbol
+	 */
+	bool writeValue(const SymInfo& symbol, const asl::ByteArray& data);
+
 	/**
 	 * Writes a variable by handle as data
 	 */
@@ -180,11 +609,13 @@ public:
 	/**
 	 * Writes a named variable as data
 	 */
-	bool writeValue(const asl::String& name, const asl::ByteArray& data)
-	{
-		Handle h = getHandle(name);
-		return !h ? false : writeValue(h, data);
-	}
+	bool writeValue(const asl::String& name, const asl::ByteArray& data);
+
+	/**
+	 * Enables or disables caching handles of named variables: named reads and writes then go through handles that
+	 * are resolved once, and are resolved again if the PLC reports them invalid or its symbol version changes
+	 */
+	void setHandleCache(bool on);
 
 	/**
 	 * Writes a string variable by handle
@@ -224,6 +655,27 @@ public:
 		return asl::StreamBufferReader(response).read<T>();
 	}
 
+	/**
+	 * Reads many variables of a specific type by handle in a single sum request; items that fail read as T() and
+	 * their ADS error codes are returned in `errors` if given
+	 */
+	template<class T>
+	asl::Array<T> readValues(const asl::Array<Handle>& handles, asl::Array<int>* errors = 0)
+	{
+		asl::Array<Result> results = sumRead(handles, sizeof(T));
+		asl::Array<T>      values(results.length());
+		if (errors)
+			errors->resize(results.length());
+		for (int i = 0; i < results.length(); i++)
+		{
+			const Result& r = results[i];
+			values[i] = (!r || r.data.length() != sizeof(T)) ? T() : asl::StreamBufferReader(r.data).read<T>();
+			if (errors)
+				(*errors)[i] = r.error;
+		}
+		return values;
+	}
+
 	/**
 	 * Reads variable array of a specific type of n items at most (by name or handle)
 	 */
@@ -235,22 +687,58 @@ public:
 		if (!response)
 			return a;
 		a.resize(response.length() / sizeof(T));
-		asl::StreamBufferReader reader(response);
-		for (int i = 0; i < a.length(); i++)
-			a[i] = reader.read<T>();
+		AdsCodec::decode(response.ptr(), a.length(), a.ptr());
 		return a;
 	}
 
+	/**
+	 * Reads variable array of a specific type of n items at most (by name or handle) into a given buffer and returns
+	 * the number of items read
+	 */
+	template<class T, class ID>
+	int readArray(const ID& id, T* values, int n)
+	{
+		asl::ByteArray response = readValue(id, n * sizeof(T));
+		int            count = response.length() / sizeof(T);
+		AdsCodec::decode(response.ptr(), count, values);
+		return count;
+	}
+
 	/**
 	 * Writes variable array of a specific type (by name or handle)
 	 */
 	template<class T, class ID>
 	bool writeArray(const ID& id, const asl::Array<T>& values)
 	{
-		asl::StreamBuffer data;
+		return writeArray(id, values.ptr(), values.length());
+	}
+
+	/**
+	 * Writes variable array of a specific type (by name or handle) from a buffer of n items
+	 */
+	template<class T, class ID>
+	bool writeArray(const ID& id, const T* values, int n)
+	{
+		asl::ByteArray data(n * sizeof(T));
+		AdsCodec::encode(values, n, data.ptr());
+		return writeValue(id, data);
+	}
+
+	/**
+	 * Writes the variables collected in a batch in a single sum request, returns the error code of each
+	 */
+	asl::Array<int> writeValues(const WriteBatch& batch) { return sumWrite(batch.handles, batch.values); }
+
+	/**
+	 * Writes many variables of a specific type by handle in a single sum request, returns the error code of each
+	 */
+	template<class T>
+	asl::Array<int> writeValues(const asl::Array<Handle>& handles, const asl::Array<T>& values)
+	{
+		asl::Array<asl::ByteArray> data;
 		for (int i = 0; i < values.length(); i++)
-			data << values[i];
-		return writeValue(id, *data);
+			data << *(asl::StreamBuffer() << values[i]);
+		return sumWrite(handles, data);
 	}
 
 	/**
@@ -271,6 +759,15 @@ public:
 		return writeValue(id, *(asl::StreamBuffer() << value));
 	}
 
+	/**
+	 * Writes a variable by symbol as a specific type
+	 */
+	template<class T>
+	bool writeValue(const SymInfo& id, const T& value)
+	{
+		return writeValue(id, *(asl::StreamBuffer() << value));
+	}
+
 	template<class T>
 	Handle addNotification(const asl::String& name, NotificationMode mode, double maxt, double cycle,
 	                       const asl::Function<void, T>& f)
@@ -278,10 +775,10 @@ public:
 		struct NotFunctor
 		{
 			asl::Function<void, T> _f;
-			void                   operator()(const asl::ByteArray& data) { _f(asl::StreamBufferReader(data).read<T>()); }
+			void                   operator()(const Sample& sample) { _f(sample.value<T>()); }
 			NotFunctor(const asl::Function<void, T>& f) : _f(f) {}
 		} ftor(f);
-		return addNotification(name, sizeof(T), mode, maxt, cycle, ftor);
+		return addSampleNotification(name, sizeof(T), mode, maxt, cycle, ftor);
 	}
 
 	/**
@@ -298,7 +795,8 @@ public:
 	}
 
 	/**
-	 * Returns the code of the last error
+	 * Returns the ADS error code of the last completed request (0 if it succeeded); it is set by the thread that
+	 * waited for that request, with several threads use the error of each request instead (e.g. `Result::error`)
 	 */
 	int lastError() const { return _adsError; }
 
@@ -312,35 +810,169 @@ public:
 	 */
 	bool hasFatalError() const;
 
+	/**
+	 * Returns a snapshot of the connection metrics: frames and bytes sent and received, requests and round-trip time
+	 * histograms per command, notification samples, timeouts, ADS errors by code and notification dispatch delay
+	 */
+	AdsMetrics::Snapshot metrics();
+
+	/**
+	 * Resets the connection metrics
+	 */
+	void resetMetrics() { _metrics.reset(); }
+
 protected:
-	asl::ByteArray getResponse();
+	struct Request;
+	struct AsyncResult;
+	struct AsyncHandle;
+	struct AsyncNotification;
+	struct AsyncRemoveNotification;
+
+	/**
+	 * The parameters of a notification, to register it again after a reconnection; `handle` is its current handle in
+	 * the PLC, which may differ from the one returned to the application
+	 */
+	struct Subscription
+	{
+		unsigned                group;
+		unsigned                offset;
+		int                     length;
+		int                     mode;
+		double                  maxt;
+		double                  cycle;
+		AdsDispatcher::Callback f;
+		unsigned                handle;
+	};
+
+	asl::ByteArray     encodeSubscription(const Subscription& s);
+	asl::Array<Result> sendAll(int command, const asl::Array<asl::ByteArray>& data);
+
+	/**
+	 * What to do when the response of an asynchronous request arrives (in the receive thread)
+	 */
+	struct Completion
+	{
+		virtual ~Completion() {}
+		virtual void complete(BeckhoffAds& ads, Request& req) = 0;
+	};
+
+	/**
+	 * An outstanding command, completed by the receive thread when the response with its invokeId arrives; waiting
+	 * requests are signaled through `done`, asynchronous ones (allocated with new) run their completion and are
+	 * deleted
+	 */
+	struct Request
+	{
+		asl::Semaphore done;
+		asl::ByteArray data;
+		int            command;
+		unsigned       invokeId;
+		int            error;
+		bool           received;
+		Completion*    completion;
+		double         sent;
+		bool           timedOut;
+		Request() : command(0), invokeId(0), error(0), received(false), completion(0), sent(0), timedOut(false) {}
+	};
+
+	asl::ByteArray getResponse(Request& req);
+	void           cancelRequests();
+	void           expireRequests();
+	void           finish(Request* req);
+	bool           sendAsync(int command, const asl::ByteArray& data, Completion* completion);
+	Result         result(const Request& req);
 	void           processNotification(const asl::ByteArray& data);
+	Handle         variableHandle(const asl::String& name);
+	Handle         cachedHandle(const asl::String& name);
+	void           invalidateHandle(const asl::String& name);
+	void           releaseStaleHandles(int minCount);
+	void           watchSymbolVersion();
+	void           symbolVersionChanged(const asl::ByteArray& data);
+	void           watchState();
+	void           stateChanged(const asl::ByteArray& data);
+	bool           open();
+	void           closeConnection();
+	void           connectionLost();
+	void           reconnectLoop();
+	bool           reopen();
+	asl::Array<Handle> restore(bool release);
+	void           stopReconnect();
+	unsigned       plcHandle(unsigned handle);
+
+	asl::Array<SymInfo> parseSymbols(const asl::ByteArray& data, int syms);
+	bool                parseDataType(asl::StreamBufferReader& reader, DataType& type);
+	bool loadSymbols(const asl::String& file, int version, unsigned syms, unsigned size, asl::Array<SymInfo>& info);
+	void saveSymbols(const asl::String& file, int version, unsigned syms, unsigned size, const asl::Array<SymInfo>& info);
 	bool           checkConnection();
+	bool           configurable();
 	void           receiveLoop();
-	bool           send(int command, const asl::ByteArray& data);
-	asl::ByteArray readPacket();
+	int            waitInput(double timeout);
+	bool           receive();
+	AdsDispatcher* dispatcher();
+	void           wakeReceiver();
+	bool           send(int command, const asl::ByteArray& data, Request& req);
+	bool           sendFrame(asl::ByteArray& frame, Request& req);
+	bool           write(unsigned group, unsigned offset, const asl::ByteArray& data, int& error);
+	asl::ByteArray read(unsigned group, unsigned offset, int length, int& error);
+	asl::ByteArray readWrite(unsigned group, unsigned offset, int length, const asl::ByteArray& data, int& error);
+	asl::ByteArray readValue(Handle handle, int n, bool exact, int& error);
+	asl::ByteArray encodeFrame(int command, const asl::ByteArray& data);
+	bool           readPacket();
+	bool           readFully(asl::byte* data, int n);
+	bool           skipBytes(int n);
 
 protected:
 	asl::Socket                                                    _socket;
 	asl::String                                                    _host;
 	asl::Mutex                                                     _mutex;
-	asl::Mutex                                                     _cmdMutex;
-	asl::Semaphore                                                 _newdata;
+	asl::Mutex                                                     _postMutex; // orders posting with removal
 	bool                                                           _connected;
 	NetId                                                          _source;
 	NetId                                                          _target;
 	unsigned                                                       _invokeId;
 	int                                                            _sourcePort;
 	int                                                            _targetPort;
+	int                                                            _tcpPort;
 	int                                                            _lastError;
 	int                                                            _adsError;
-	asl::Array<unsigned>                                           _handles;
-	asl::Array<unsigned>                                           _notifications;
-	asl::Map<asl::ULong, asl::ByteArray>                           _responses;
-	asl::ByteArray                                                 _response;
+	asl::Map<unsigned, asl::String>                                _handles;
+	asl::Map<unsigned, Subscription>                               _subscriptions;
+	asl::Map<unsigned, unsigned>                                   _notifAlias;
+	asl::Array<unsigned>                                           _staleHandles;
+	asl::Map<asl::String, Handle>                                  _handleCache;
+	bool                                                           _useHandleCache;
+	int                                                            _symVersion;
+	asl::String                                                    _symbolCacheDir;
+	asl::Map<unsigned, Request*>                                   _requests;
+	asl::ByteArray                                                 _header;
+	asl::ByteArray                                                 _rxBuffer;
+	asl::ByteArray                                                 _frame;     // frame being received by a reactor
+	int                                                            _framePos;  // bytes of it received so far
+	const asl::byte*                                               _frameData; // complete frame being parsed
+	int                                                            _frameLeft;
+	int                                                            _maxFrame;
+	double                                                         _timeout;
+	double                                                         _nextExpiry;
+	int                                                            _maxChunk;
 	BeckhoffThread*                                                _thread;
-	asl::ULong                                                     _lastRequestId;
-	asl::Map<unsigned, asl::Function<void, const asl::ByteArray&>> _callbacks;
+	int                                                            _wakeup[2];
+	AdsDispatcher*                                                 _dispatcher;
+	AdsReactor*                                                    _reactor;
+	bool                                                           _attached;
+	bool                                                           _sharedDispatch;
+	int                                                            _id;
+	AdsMetrics                                                     _metrics;
+	asl::Map<unsigned, AdsDispatcher::Callback>                    _callbacks;
+	bool                                                           _autoReconnect;
+	double                                                         _maxReconnectDelay;
+	BeckhoffReconnectThread*                                       _reconnectThread;
+	asl::Semaphore                                                 _reconnectEvent;
+	bool                                                           _stopReconnect;
+	bool                                                           _plcRestarted;
+	volatile asl::ULong                                            _reconnectThreadId;
+	int                                                            _plcState;
+	asl::Function<void, const asl::Array<Handle>&>                 _onReconnect;
+	asl::AtomicCount                                               _reconnections;
 };
 
 #endif
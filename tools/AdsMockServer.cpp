@@ -0,0 +1,672 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#include "AdsMockServer.h"
+#include <asl/StreamBuffer.h>
+#include <asl/Thread.h>
+#include <asl/time.h>
+#include <stdlib.h>
+
+typedef unsigned int   uint32_t;
+typedef unsigned short uint16_t;
+
+using namespace asl;
+
+enum
+{
+	ADSCOM_READDEVICEINFO = 1,
+	ADSCOM_READ = 2,
+	ADSCOM_WRITE = 3,
+	ADSCOM_READSTATE = 4,
+	ADSCOM_WRITECTRL = 5,
+	ADSCOM_ADDDEVICENOTIF = 6,
+	ADSCOM_DELDEVICENOTIF = 7,
+	ADSCOM_DEVICENOTIF = 8,
+	ADSCOM_READWRITE = 9
+};
+
+enum
+{
+	ADSIGRP_MEMORY = 0x4020,
+	ADSIGRP_HNDBYNAME = 0xF003,
+	ADSIGRP_VALBYNAME = 0xF004,
+	ADSIGRP_VALBYHND = 0xF005,
+	ADSIGRP_RELEASEHND = 0xF006,
+	ADSIGRP_VERSION = 0xF008,
+	ADSIGRP_INFOBYNAMEEX = 0xF009,
+	ADSIGRP_SYM_UPLOAD = 0xF00B,
+	ADSIGRP_SYM_UPLOADINFO = 0xF00C,
+	ADSIGRP_SYM_DT_UPLOAD = 0xF00E,
+	ADSIGRP_SYM_UPLOADINFO2 = 0xF00F,
+	ADSIGRP_SUMUP_READ = 0xF080,
+	ADSIGRP_SUMUP_WRITE = 0xF081,
+	ADSIGRP_SUMUP_READWRITE = 0xF082,
+	ADSIGRP_DEVICE_DATA = 0xF100
+};
+
+enum
+{
+	ADSERR_SRV_NOTSUPP = 1793,
+	ADSERR_INVALIDGRP = 1794,
+	ADSERR_INVALIDSIZE = 1797,
+	ADSERR_SYMBOLNOTFOUND = 1808,
+	ADSERR_INVALIDHANDLE = 1809,
+	ADSERR_NOTIFYHNDINVALID = 1812
+};
+
+enum
+{
+	ADSTRANS_SERVERCYCLE = 3,
+	ADSTRANS_SERVERONCHA = 4
+};
+
+const int MAX_FRAME = 8 << 20;
+
+struct AdsMockAcceptThread : public asl::Thread
+{
+	AdsMockServer* _server;
+
+	void run() { _server->acceptLoop(); }
+};
+
+struct AdsMockClientThread : public asl::Thread
+{
+	AdsMockServer* _server;
+	Socket         _socket;
+	volatile bool  _done;
+
+	void run()
+	{
+		_server->serve(_socket);
+		_done = true;
+	}
+};
+
+static bool readFully(Socket& socket, byte* data, int n)
+{
+	while (n > 0)
+	{
+		int m = socket.read(data, n);
+		if (m <= 0)
+			return false;
+		data += m;
+		n -= m;
+	}
+	return true;
+}
+
+inline ULong toFileTime(double t)
+{
+	return ULong((t + 11644473600.0) / 100e-9);
+}
+
+AdsMockServer::AdsMockServer()
+{
+	_nextHandle = 0x10000;
+	_nextPort = 32905;
+	_latency = 0;
+	_jitter = 0;
+	_acceptThread = 0;
+	_adsState = 5;
+	_stop = false;
+}
+
+AdsMockServer::~AdsMockServer()
+{
+	stop();
+}
+
+bool AdsMockServer::start(int port)
+{
+	if (_acceptThread)
+		return true;
+	_listener = Socket();
+	if (!_listener.bind("0.0.0.0", port) || !_listener.listen())
+	{
+		printf("ADS mock: cannot listen on port %i\n", port);
+		return false;
+	}
+	_stop = false;
+	_acceptThread = new AdsMockAcceptThread;
+	_acceptThread->_server = this;
+	_acceptThread->start();
+	return true;
+}
+
+void AdsMockServer::stop()
+{
+	if (!_acceptThread)
+		return;
+	_stop = true;
+	_acceptThread->join();
+	delete _acceptThread;
+	_acceptThread = 0;
+	_listener.close();
+
+	Array<AdsMockClientThread*> clients;
+	{
+		Lock _(_mutex);
+		clients = _clients;
+		_clients = Array<AdsMockClientThread*>();
+	}
+	foreach (AdsMockClientThread* client, clients)
+	{
+		client->join();
+		delete client;
+	}
+}
+
+void AdsMockServer::setLatency(double latency, double jitter)
+{
+	_latency = latency;
+	_jitter = jitter;
+}
+
+unsigned AdsMockServer::addVariable(const String& name, const String& type, int typecode, int size,
+                                    const ByteArray& value)
+{
+	Lock _(_mutex);
+	Var var = { name, type, typecode, size, (unsigned)_memory.length() };
+	_names[name.toLowerCase()] = _vars.length();
+	_vars << var;
+	_memory.resize(_memory.length() + size);
+	memset(_memory.ptr() + var.offset, 0, size);
+	if (value.length() > 0)
+		memcpy(_memory.ptr() + var.offset, value.ptr(), min(size, value.length()));
+	return var.offset;
+}
+
+int AdsMockServer::findVar(const String& name)
+{
+	return _names.get(name.toLowerCase(), -1);
+}
+
+ByteArray AdsMockServer::value(const String& name)
+{
+	Lock _(_mutex);
+	int i = findVar(name);
+	return i < 0 ? ByteArray() : ByteArray(_memory.ptr() + _vars[i].offset, _vars[i].size);
+}
+
+bool AdsMockServer::setValue(const String& name, const ByteArray& value)
+{
+	Lock _(_mutex);
+	int i = findVar(name);
+	if (i < 0)
+		return false;
+	memcpy(_memory.ptr() + _vars[i].offset, value.ptr(), min(_vars[i].size, value.length()));
+	return true;
+}
+
+// returns the simulated latency of a response, with a per-client generator as clients run in parallel
+
+double AdsMockServer::delay(Client& client)
+{
+	if (_jitter <= 0)
+		return _latency;
+	client.random = client.random * 1103515245 + 12345;
+	double r = (client.random >> 8) / double(1 << 24); // [0, 1)
+	return _latency + _jitter * (2 * r - 1);
+}
+
+// sends a response now or queues it until its latency has passed
+
+bool AdsMockServer::reply(Client& client, const ByteArray& frame)
+{
+	double t = delay(client);
+	if (t <= 0 && client.pending.length() == 0)
+		return client.socket.write(frame.ptr(), frame.length()) == frame.length();
+	Pending p = { now() + t, frame };
+	client.pending << p;
+	return true;
+}
+
+// sends the queued responses that are due, in order of due time
+
+bool AdsMockServer::sendDue(Client& client)
+{
+	double t = now();
+	while (client.pending.length() > 0)
+	{
+		int next = 0;
+		for (int i = 1; i < client.pending.length(); i++)
+			if (client.pending[i].due < client.pending[next].due)
+				next = i;
+		if (client.pending[next].due > t)
+			break;
+		const ByteArray& frame = client.pending[next].frame;
+		if (client.socket.write(frame.ptr(), frame.length()) != frame.length())
+			return false;
+		client.pending.remove(next);
+	}
+	return true;
+}
+
+void AdsMockServer::acceptLoop()
+{
+	while (!_stop)
+	{
+		if (!_listener.waitInput(0.1))
+			continue;
+		Socket socket = _listener.accept();
+		if (!socket)
+			continue;
+		pruneClients();
+		AdsMockClientThread* client = new AdsMockClientThread;
+		client->_server = this;
+		client->_socket = socket;
+		client->_done = false;
+		{
+			Lock _(_mutex);
+			_clients << client;
+		}
+		client->start();
+	}
+}
+
+// joins and deletes the threads of clients that have disconnected
+
+void AdsMockServer::pruneClients()
+{
+	Array<AdsMockClientThread*> finished;
+	{
+		Lock _(_mutex);
+		for (int i = _clients.length() - 1; i >= 0; i--)
+		{
+			if (!_clients[i]->_done)
+				continue;
+			finished << _clients[i];
+			_clients.remove(i);
+		}
+	}
+	foreach (AdsMockClientThread* client, finished)
+	{
+		client->join();
+		delete client;
+	}
+}
+
+void AdsMockServer::serve(Socket socket)
+{
+	Client client;
+	client.socket = socket;
+	client.nextNotification = 1;
+	client.random = (unsigned)(now() * 1e6) ^ (unsigned)(size_t)&client;
+
+	while (!_stop)
+	{
+		// wait for requests until the next notification or delayed response is due
+
+		double timeout = 0.05, t = now();
+		foreach (Notification& n, client.notifications)
+			timeout = clamp(n.next - t, 0.0, timeout);
+		foreach (Pending& p, client.pending)
+			timeout = clamp(p.due - t, 0.0, timeout);
+
+		if (socket.waitInput(timeout))
+		{
+			if (socket.disconnected() || !serveFrame(client))
+				break;
+		}
+		if (!sendDue(client))
+			break;
+		sendNotifications(client);
+	}
+	socket.close();
+}
+
+bool AdsMockServer::serveFrame(Client& client)
+{
+	Socket&   socket = client.socket;
+	ByteArray header(38);
+	if (!readFully(socket, header.ptr(), 6))
+		return false;
+
+	StreamBufferReader reader(header);
+	uint16_t           reserved;
+	uint32_t           length;
+	reader >> reserved >> length;
+
+	if (length > (uint32_t)MAX_FRAME)
+		return false;
+
+	// AMS router port registration of local clients: answer a NetId and a free port
+
+	if (reserved == 0x1000)
+	{
+		ByteArray request(length);
+		if (!readFully(socket, request.ptr(), length))
+			return false;
+		StreamBuffer response(ENDIAN_LITTLE);
+		response << uint16_t(0x1000) << uint32_t(8) << (ByteArray(), 127, 0, 0, 1, 1, 1);
+		{
+			Lock _(_mutex);
+			response << uint16_t(_nextPort++);
+		}
+		return socket.write(response.ptr(), response.length()) == response.length();
+	}
+
+	if (reserved != 0 || length < 32 || !readFully(socket, header.ptr() + 6, 32))
+		return false;
+
+	ByteArray data(length - 32);
+	if (!readFully(socket, data.ptr(), data.length()))
+		return false;
+
+	uint16_t command, flags;
+	uint32_t dataLen, error, invokeId;
+	reader.skip(16);
+	reader >> command >> flags >> dataLen >> error >> invokeId;
+
+	client.server = ByteArray(header.ptr() + 6, 8);
+	client.address = ByteArray(header.ptr() + 14, 8);
+
+	++_requests;
+
+	StreamBufferReader request(data);
+	StreamBuffer       response(ENDIAN_LITTLE);
+
+	switch (command)
+	{
+	case ADSCOM_READDEVICEINFO: {
+		ByteArray name(16, 0);
+		memcpy(name.ptr(), "ADS mock", 8);
+		response << uint32_t(0) << byte(3) << byte(1) << uint16_t(4024) << name;
+		break;
+	}
+	case ADSCOM_READSTATE: response << uint32_t(0) << uint16_t(_adsState) << uint16_t(0); break;
+	case ADSCOM_WRITECTRL: response << uint32_t(0); break;
+	case ADSCOM_READ: {
+		uint32_t  group = 0, offset = 0, len = 0;
+		ByteArray out;
+		if (request.length() >= 12)
+			request >> group >> offset >> len;
+		int err = read(group, offset, len, out);
+		response << uint32_t(err) << uint32_t(out.length()) << out;
+		break;
+	}
+	case ADSCOM_WRITE: {
+		uint32_t group = 0, offset = 0, len = 0;
+		if (request.length() >= 12)
+			request >> group >> offset >> len;
+		int err = (int)len <= request.length() ? write(group, offset, request.read(len)) : ADSERR_INVALIDSIZE;
+		response << uint32_t(err);
+		break;
+	}
+	case ADSCOM_READWRITE: {
+		uint32_t  group = 0, offset = 0, rlen = 0, wlen = 0;
+		ByteArray out;
+		if (request.length() >= 16)
+			request >> group >> offset >> rlen >> wlen;
+		int err = (int)wlen <= request.length() ? readWrite(group, offset, rlen, request.read(wlen), out)
+		                                        : ADSERR_INVALIDSIZE;
+		response << uint32_t(err) << uint32_t(out.length()) << out;
+		break;
+	}
+	case ADSCOM_ADDDEVICENOTIF: {
+		Notification n;
+		uint32_t     group = 0, offset = 0, len = 0, mode = 0, maxDelay = 0, cycle = 0;
+		if (request.length() >= 24)
+			request >> group >> offset >> len >> mode >> maxDelay >> cycle;
+		ByteArray probe;
+		int       err = read(group, offset, len, probe);
+		if (err == 0)
+		{
+			n.handle = client.nextNotification++;
+			n.group = group;
+			n.offset = offset;
+			n.length = len;
+			n.mode = mode;
+			n.cycle = max(cycle * 100e-9, 0.001);
+			n.next = now();
+			client.notifications[n.handle] = n;
+		}
+		response << uint32_t(err) << uint32_t(err == 0 ? n.handle : 0);
+		break;
+	}
+	case ADSCOM_DELDEVICENOTIF: {
+		uint32_t handle = request.length() >= 4 ? request.read<uint32_t>() : 0;
+		bool     found = client.notifications.has(handle);
+		client.notifications.remove(handle);
+		response << uint32_t(found ? 0 : ADSERR_NOTIFYHNDINVALID);
+		break;
+	}
+	default: response << uint32_t(ADSERR_SRV_NOTSUPP);
+	}
+
+	StreamBuffer frame(ENDIAN_LITTLE);
+	frame << uint16_t(0) << uint32_t(32 + response.length());
+	frame << client.address << client.server;
+	frame << command << uint16_t(0x0005) << uint32_t(response.length()) << uint32_t(0) << invokeId;
+	frame << *response;
+	return reply(client, *frame);
+}
+
+void AdsMockServer::sendNotifications(Client& client)
+{
+	if (client.notifications.length() == 0 || !client.address)
+		return;
+
+	double       t = now();
+	StreamBuffer samples(ENDIAN_LITTLE);
+	int          count = 0;
+
+	foreach (Notification& n, client.notifications)
+	{
+		if (n.next > t)
+			continue;
+		n.next = max(n.next + n.cycle, t);
+		ByteArray data;
+		if (read(n.group, n.offset, n.length, data) != 0)
+			continue;
+		if (n.mode == ADSTRANS_SERVERONCHA && data == n.last)
+			continue;
+		n.last = data;
+		samples << uint32_t(n.handle) << uint32_t(data.length()) << data;
+		count++;
+	}
+
+	if (count == 0)
+		return;
+
+	StreamBuffer body(ENDIAN_LITTLE);
+	body << uint32_t(16 + samples.length()) << uint32_t(1) << toFileTime(t) << uint32_t(count) << *samples;
+
+	StreamBuffer frame(ENDIAN_LITTLE);
+	frame << uint16_t(0) << uint32_t(32 + body.length());
+	frame << client.address << client.server;
+	frame << uint16_t(ADSCOM_DEVICENOTIF) << uint16_t(0x0004) << uint32_t(body.length()) << uint32_t(0) << uint32_t(0);
+	frame << *body;
+	client.socket.write(frame.ptr(), frame.length());
+}
+
+int AdsMockServer::read(unsigned group, unsigned offset, int length, ByteArray& data)
+{
+	Lock _(_mutex);
+
+	switch (group)
+	{
+	case ADSIGRP_MEMORY:
+		if (length < 0 || offset + length > (unsigned)_memory.length())
+			return ADSERR_INVALIDSIZE;
+		data = ByteArray(_memory.ptr() + offset, length);
+		return 0;
+
+	case ADSIGRP_VALBYHND: {
+		if (!_handles.has(offset))
+			return ADSERR_INVALIDHANDLE;
+		const Var& var = _vars[_handles[offset]];
+		data = ByteArray(_memory.ptr() + var.offset, min(length, var.size));
+		return 0;
+	}
+	case ADSIGRP_VERSION: data = ByteArray(1, 1); return 0;
+
+	case ADSIGRP_DEVICE_DATA: {
+		// ADS state at offset 0 and device state at offset 2
+		ByteArray state = *(StreamBuffer(ENDIAN_LITTLE) << uint16_t(_adsState) << uint16_t(0));
+		if (length < 0 || offset + length > (unsigned)state.length())
+			return ADSERR_INVALIDSIZE;
+		data = ByteArray(state.ptr() + offset, length);
+		return 0;
+	}
+
+	case ADSIGRP_SYM_UPLOADINFO:
+	case ADSIGRP_SYM_UPLOADINFO2:
+	case ADSIGRP_SYM_UPLOAD: {
+		StreamBuffer symbols(ENDIAN_LITTLE);
+		foreach (const Var& var, _vars)
+			encodeSymbol(symbols, var);
+		if (group == ADSIGRP_SYM_UPLOAD)
+		{
+			data = *symbols;
+			data.resize(min(length, data.length()));
+			return 0;
+		}
+		StreamBuffer info(ENDIAN_LITTLE);
+		info << uint32_t(_vars.length()) << uint32_t(symbols.length()) << uint32_t(0) << uint32_t(0) << uint32_t(0)
+		     << uint32_t(0);
+		data = *info;
+		data.resize(min(length, data.length()));
+		return 0;
+	}
+	case ADSIGRP_SYM_DT_UPLOAD: data = ByteArray(); return 0;
+	}
+	return ADSERR_INVALIDGRP;
+}
+
+int AdsMockServer::write(unsigned group, unsigned offset, const ByteArray& data)
+{
+	Lock _(_mutex);
+
+	switch (group)
+	{
+	case ADSIGRP_MEMORY:
+		if (offset + data.length() > (unsigned)_memory.length())
+			return ADSERR_INVALIDSIZE;
+		memcpy(_memory.ptr() + offset, data.ptr(), data.length());
+		return 0;
+
+	case ADSIGRP_VALBYHND: {
+		if (!_handles.has(offset))
+			return ADSERR_INVALIDHANDLE;
+		const Var& var = _vars[_handles[offset]];
+		if (data.length() > var.size)
+			return ADSERR_INVALIDSIZE;
+		memcpy(_memory.ptr() + var.offset, data.ptr(), data.length());
+		return 0;
+	}
+	case ADSIGRP_RELEASEHND: {
+		if (data.length() < 4)
+			return ADSERR_INVALIDSIZE;
+		unsigned handle = StreamBufferReader(data).read<uint32_t>();
+		if (!_handles.has(handle))
+			return ADSERR_INVALIDHANDLE;
+		_handles.remove(handle);
+		return 0;
+	}
+	}
+	return ADSERR_INVALIDGRP;
+}
+
+void AdsMockServer::encodeSymbol(StreamBuffer& buffer, const Var& var)
+{
+	int length = 30 + var.name.length() + var.type.length() + 3;
+	buffer << uint32_t(length) << uint32_t(ADSIGRP_MEMORY) << uint32_t(var.offset) << uint32_t(var.size)
+	       << uint32_t(var.typecode) << uint32_t(0) << uint16_t(var.name.length()) << uint16_t(var.type.length())
+	       << uint16_t(0);
+	buffer << ByteArray((const byte*)*var.name, var.name.length() + 1);
+	buffer << ByteArray((const byte*)*var.type, var.type.length() + 1);
+	buffer << byte(0);
+}
+
+int AdsMockServer::readWrite(unsigned group, unsigned offset, int length, const ByteArray& data, ByteArray& out)
+{
+	switch (group)
+	{
+	case ADSIGRP_HNDBYNAME:
+	case ADSIGRP_VALBYNAME:
+	case ADSIGRP_INFOBYNAMEEX: {
+		Lock   _(_mutex);
+		String name = String(data).fix();
+		int    i = findVar(name);
+		if (i < 0)
+			return ADSERR_SYMBOLNOTFOUND;
+		const Var& var = _vars[i];
+		if (group == ADSIGRP_HNDBYNAME)
+		{
+			unsigned handle = _nextHandle++;
+			_handles[handle] = i;
+			out = *(StreamBuffer(ENDIAN_LITTLE) << uint32_t(handle));
+		}
+		else if (group == ADSIGRP_VALBYNAME)
+			out = ByteArray(_memory.ptr() + var.offset, min(length, var.size));
+		else
+		{
+			StreamBuffer buffer(ENDIAN_LITTLE);
+			encodeSymbol(buffer, var);
+			out = *buffer;
+		}
+		return 0;
+	}
+
+	// sum commands: `offset` is the number of items, their headers come first and then their write data
+
+	case ADSIGRP_SUMUP_READ: {
+		StreamBufferReader items(data);
+		StreamBuffer       errors(ENDIAN_LITTLE), values(ENDIAN_LITTLE);
+		if (items.length() < 12 * (int)offset)
+			return ADSERR_INVALIDSIZE;
+		for (unsigned i = 0; i < offset; i++)
+		{
+			uint32_t  g, o, n;
+			ByteArray value;
+			items >> g >> o >> n;
+			int err = read(g, o, n, value);
+			if (err != 0 || value.length() != (int)n)
+				value = ByteArray(n, 0); // each item keeps its requested length
+			errors << uint32_t(err);
+			values << value;
+		}
+		out = *(errors << *values);
+		return 0;
+	}
+	case ADSIGRP_SUMUP_WRITE: {
+		StreamBufferReader items(data);
+		StreamBuffer       errors(ENDIAN_LITTLE);
+		if (items.length() < 12 * (int)offset)
+			return ADSERR_INVALIDSIZE;
+		StreamBufferReader values(data.ptr() + 12 * offset, data.length() - 12 * offset);
+		for (unsigned i = 0; i < offset; i++)
+		{
+			uint32_t g, o, n;
+			items >> g >> o >> n;
+			if (values.length() < (int)n)
+				return ADSERR_INVALIDSIZE;
+			errors << uint32_t(write(g, o, values.read(n)));
+		}
+		out = *errors;
+		return 0;
+	}
+	case ADSIGRP_SUMUP_READWRITE: {
+		StreamBufferReader items(data);
+		StreamBuffer       results(ENDIAN_LITTLE), values(ENDIAN_LITTLE);
+		if (items.length() < 16 * (int)offset)
+			return ADSERR_INVALIDSIZE;
+		StreamBufferReader writes(data.ptr() + 16 * offset, data.length() - 16 * offset);
+		for (unsigned i = 0; i < offset; i++)
+		{
+			uint32_t  g, o, rn, wn;
+			ByteArray value;
+			items >> g >> o >> rn >> wn;
+			if (writes.length() < (int)wn)
+				return ADSERR_INVALIDSIZE;
+			int err = readWrite(g, o, rn, writes.read(wn), value);
+			results << uint32_t(err) << uint32_t(value.length());
+			values << value;
+		}
+		out = *(results << *values);
+		return 0;
+	}
+	}
+	return ADSERR_INVALIDGRP;
+}
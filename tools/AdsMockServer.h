@@ -0,0 +1,178 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef ASLADSMOCKSERVER_H
+#define ASLADSMOCKSERVER_H
+
+#include <asl/Socket.h>
+#include <asl/StreamBuffer.h>
+#include <asl/Mutex.h>
+#include <asl/Map.h>
+#include <asl/HashMap.h>
+#include <asl/atomic.h>
+
+struct AdsMockAcceptThread;
+struct AdsMockClientThread;
+
+/**
+ * A minimal ADS server over TCP for testing and benchmarking clients without a PLC. It handles the AMS router port
+ * registration done by local clients, device info and state (also readable and notified as group 0xF100), reads and
+ * writes of a PLC memory area (group 0x4020) where variables are allocated, variable handles, access by name and
+ * handle, symbol info and upload, sum commands and device notifications. Responses can be delayed by a configurable
+ * latency and jitter.
+ *
+ * ```
+ * AdsMockServer server;
+ * server.addVariable("GVL.speed", "REAL", 4, 4);
+ * server.start(48898);
+ * ```
+ */
+class AdsMockServer
+{
+	friend AdsMockAcceptThread;
+	friend AdsMockClientThread;
+
+public:
+	AdsMockServer();
+	~AdsMockServer();
+
+	/**
+	 * Starts listening on a TCP port, returns false if it cannot
+	 */
+	bool start(int port = 48898);
+
+	/**
+	 * Stops serving and closes all connections
+	 */
+	void stop();
+
+	/**
+	 * Delays each response by `latency` seconds plus a random amount up to +-`jitter`; requests are still served as
+	 * they arrive, so pipelined requests overlap their delays as with a real network round trip
+	 */
+	void setLatency(double latency, double jitter = 0);
+
+	/**
+	 * Adds a variable with a name, PLC type name, ADS type code and byte size, with an optional initial value, and
+	 * returns its offset in the memory area
+	 */
+	unsigned addVariable(const asl::String& name, const asl::String& type, int typecode, int size,
+	                     const asl::ByteArray& value = asl::ByteArray());
+
+	/**
+	 * Returns the current value of a variable
+	 */
+	asl::ByteArray value(const asl::String& name);
+
+	/**
+	 * Sets the value of a variable (clients with change notifications get the new value)
+	 */
+	bool setValue(const asl::String& name, const asl::ByteArray& value);
+
+	template<class T>
+	T value(const asl::String& name)
+	{
+		asl::ByteArray data = value(name);
+		T              x = T();
+		if (data.length() == sizeof(T))
+			memcpy(&x, data.ptr(), sizeof(T));
+		return x;
+	}
+
+	template<class T>
+	bool setValue(const asl::String& name, const T& x)
+	{
+		return setValue(name, asl::ByteArray((const asl::byte*)&x, sizeof(T)));
+	}
+
+	/**
+	 * Sets the ADS state reported to clients (5 = RUN, 6 = STOP...), clients watching the device state get notified
+	 */
+	void setState(int state) { _adsState = state; }
+
+	/**
+	 * Returns the ADS state reported to clients
+	 */
+	int state() const { return _adsState; }
+
+	/**
+	 * Returns the number of requests served
+	 */
+	int requests() const { return _requests; }
+
+protected:
+	struct Var
+	{
+		asl::String name;
+		asl::String type;
+		int         typecode;
+		int         size;
+		unsigned    offset;
+	};
+
+	struct Notification
+	{
+		unsigned       handle;
+		unsigned       group;
+		unsigned       offset;
+		int            length;
+		int            mode;
+		double         cycle;
+		double         next;
+		asl::ByteArray last;
+	};
+
+	/**
+	 * A response waiting to be sent when its simulated latency has passed
+	 */
+	struct Pending
+	{
+		double         due;
+		asl::ByteArray frame;
+	};
+
+	struct Client
+	{
+		asl::Socket                      socket;
+		asl::Array<Pending>              pending;
+		unsigned                         random; // state of the client's random generator
+		asl::ByteArray                   address; // NetId and port of the client, from its requests
+		asl::ByteArray                   server;  // NetId and port the client addresses
+		asl::Map<unsigned, Notification> notifications;
+		unsigned                         nextNotification;
+	};
+
+	void acceptLoop();
+	void serve(asl::Socket socket);
+	bool serveFrame(Client& client);
+	void sendNotifications(Client& client);
+	double delay(Client& client);
+	bool   reply(Client& client, const asl::ByteArray& frame);
+	bool   sendDue(Client& client);
+	void pruneClients();
+
+	int  read(unsigned group, unsigned offset, int length, asl::ByteArray& data);
+	int  write(unsigned group, unsigned offset, const asl::ByteArray& data);
+	int  readWrite(unsigned group, unsigned offset, int length, const asl::ByteArray& data, asl::ByteArray& out);
+	int  findVar(const asl::String& name);
+	void encodeSymbol(asl::StreamBuffer& buffer, const Var& var);
+
+protected:
+	asl::Socket                      _listener;
+	asl::Mutex                       _mutex;
+	asl::ByteArray                   _memory;
+	asl::Array<Var>                  _vars;
+	asl::HashMap<asl::String, int>   _names;
+	asl::Map<unsigned, int>          _handles;
+	unsigned                         _nextHandle;
+	unsigned                         _nextPort;
+	double                           _latency;
+	double                           _jitter;
+	AdsMockAcceptThread*             _acceptThread;
+	asl::Array<AdsMockClientThread*> _clients;
+	asl::AtomicCount                 _requests;
+	volatile int                     _adsState;
+	volatile bool                    _stop;
+};
+
+#endif
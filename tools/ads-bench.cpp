@@ -0,0 +1,224 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+// Client benchmarks against an in-process mock ADS server over loopback, results written as JSON:
+//   ads-bench [seconds per test] [latency] [output.json]
+
+#include "AdsMockServer.h"
+#include "BeckhoffAds.h"
+#include <asl/time.h>
+#include <asl/Mutex.h>
+#include <algorithm>
+#include <stdlib.h>
+
+using namespace asl;
+
+const int BENCH_PORT = 48931;
+
+struct Result
+{
+	String        name;
+	int           ops;
+	double        seconds;
+	Array<double> latencies;
+};
+
+double percentile(const Array<double>& sorted, double p)
+{
+	if (sorted.length() == 0)
+		return 0;
+	return sorted[min(int(p * sorted.length()), sorted.length() - 1)];
+}
+
+// runs an operation repeatedly for some time, timing each call
+
+template<class F>
+Result bench(const String& name, double duration, F f)
+{
+	Result r;
+	r.name = name;
+	r.ops = 0;
+	double t0 = now(), t = t0;
+	while (t - t0 < duration)
+	{
+		f();
+		double t1 = now();
+		r.latencies << (t1 - t);
+		r.ops++;
+		t = t1;
+	}
+	r.seconds = t - t0;
+	printf("%-28s %9.0f ops/s\n", *name, r.ops / r.seconds);
+	return r;
+}
+
+struct ReadByName
+{
+	BeckhoffAds* plc;
+	void         operator()() { plc->readValue<float>(String("bench.real")); }
+};
+
+struct ReadByHandle
+{
+	BeckhoffAds*        plc;
+	BeckhoffAds::Handle h;
+	void                operator()() { plc->readValue<float>(h); }
+};
+
+struct WriteByHandle
+{
+	BeckhoffAds*        plc;
+	BeckhoffAds::Handle h;
+	void                operator()() { plc->writeValue(h, 1.5f); }
+};
+
+struct ReadArray
+{
+	BeckhoffAds*        plc;
+	BeckhoffAds::Handle h;
+	Array<float>        values;
+	void                operator()() { plc->readArray(h, values.ptr(), values.length()); }
+};
+
+struct GetSymbols
+{
+	BeckhoffAds* plc;
+	void         operator()() { plc->getSymbols(); }
+};
+
+// collects notification samples and their delivery latency (the mock stamps them with the same clock)
+
+struct FanIn
+{
+	Mutex         mutex;
+	Array<double> latencies;
+
+	void add(const Array<BeckhoffAds::Sample>& samples)
+	{
+		double t = now();
+		Lock   _(mutex);
+		foreach (const BeckhoffAds::Sample& s, samples)
+			latencies << (t - s.time);
+	}
+};
+
+struct FanInCallback
+{
+	FanIn* fanin;
+	void   operator()(const Array<BeckhoffAds::Sample>& samples) { fanin->add(samples); }
+};
+
+Result notificationFanIn(BeckhoffAds& plc, int count, double duration)
+{
+	FanIn                      fanin;
+	FanInCallback              callback = { &fanin };
+	Array<BeckhoffAds::Handle> handles;
+
+	for (int i = 0; i < count; i++)
+		handles << plc.addBatchNotification(String::f("bench.n%i", i), 4, BeckhoffAds::NOTIF_CYCLE, 0, 0.001,
+		                                    callback);
+	{
+		Lock _(fanin.mutex);
+		fanin.latencies.clear();
+	}
+	sleep(duration);
+
+	Result r;
+	{
+		Lock _(fanin.mutex);
+		r.latencies = fanin.latencies;
+		fanin.latencies = Array<double>();
+	}
+	foreach (BeckhoffAds::Handle& h, handles)
+		plc.removeNotification(h);
+
+	r.name = String::f("notifications_%ikhz", count);
+	r.ops = r.latencies.length();
+	r.seconds = duration;
+	printf("%-28s %9.0f samples/s\n", *r.name, r.ops / r.seconds);
+	return r;
+}
+
+String toJson(Array<Result>& results, double latency)
+{
+	String json = String::f("{\n\t\"server_latency\": %g,\n\t\"results\": [", latency);
+	for (int i = 0; i < results.length(); i++)
+	{
+		Result&        r = results[i];
+		Array<double>& l = r.latencies;
+		std::sort(l.ptr(), l.ptr() + l.length());
+		json += String::f("%s\n\t\t{\"name\": \"%s\", \"ops\": %i, \"ops_per_sec\": %.1f, \"p50_us\": %.1f, "
+		                  "\"p99_us\": %.1f, \"p999_us\": %.1f}",
+		                  i > 0 ? "," : "", *r.name, r.ops, r.ops / r.seconds, percentile(l, 0.5) * 1e6,
+		                  percentile(l, 0.99) * 1e6, percentile(l, 0.999) * 1e6);
+	}
+	json += "\n\t]\n}\n";
+	return json;
+}
+
+int main(int argc, char* argv[])
+{
+	double duration = argc > 1 ? atof(argv[1]) : 2.0;
+	double latency = argc > 2 ? atof(argv[2]) : 0;
+	String output = argc > 3 ? argv[3] : "";
+
+	AdsMockServer server;
+	server.setLatency(latency);
+	server.addVariable("bench.real", "REAL", BeckhoffAds::ADST_REAL32, 4);
+	server.addVariable("bench.array", "ARRAY [0..9999] OF REAL", BeckhoffAds::ADST_REAL32, 40000);
+	for (int i = 0; i < 100; i++)
+		server.addVariable(String::f("bench.n%i", i), "DINT", BeckhoffAds::ADST_INT32, 4);
+	for (int i = 0; i < 10000; i++)
+		server.addVariable(String::f("bench.table.symbol%i", i), "LREAL", BeckhoffAds::ADST_REAL64, 8);
+
+	if (!server.start(BENCH_PORT))
+		return 1;
+
+	BeckhoffAds plc;
+	plc.setTcpPort(BENCH_PORT);
+	if (!plc.connect("127.0.0.1"))
+		return 1;
+
+	Array<Result> results;
+
+	ReadByName readByName = { &plc };
+	results << bench("read_by_name", duration, readByName);
+
+	BeckhoffAds::Handle real = plc.getHandle("bench.real");
+	ReadByHandle        readByHandle = { &plc, real };
+	results << bench("read_by_handle", duration, readByHandle);
+
+	WriteByHandle writeByHandle = { &plc, real };
+	results << bench("write_by_handle", duration, writeByHandle);
+
+	BeckhoffAds::Handle array = plc.getHandle("bench.array");
+	int                 sizes[] = { 10, 100, 1000, 10000 };
+	for (int i = 0; i < 4; i++)
+	{
+		ReadArray readArray = { &plc, array, Array<float>(sizes[i]) };
+		results << bench(String::f("read_array_%i", sizes[i]), duration, readArray);
+	}
+
+	GetSymbols getSymbols = { &plc };
+	results << bench("get_symbols_10k", duration, getSymbols);
+
+	results << notificationFanIn(plc, 1, duration);
+	results << notificationFanIn(plc, 10, duration);
+	results << notificationFanIn(plc, 100, duration);
+
+	plc.disconnect();
+	server.stop();
+
+	String json = toJson(results, latency);
+	if (output.ok())
+	{
+		FILE* file = fopen(*output, "wt");
+		if (!file)
+			return 1;
+		fputs(*json, file);
+		fclose(file);
+	}
+	else
+		printf("%s", *json);
+	return 0;
+}
@@ -0,0 +1,44 @@
+// Copyright(c) 2019-2022 aslze
+// Licensed under the MIT License (http://opensource.org/licenses/MIT)
+
+// A mock ADS server with a few variables, for trying clients without a PLC:
+//   ads-mock-server [port] [latency] [jitter]
+
+#include "AdsMockServer.h"
+#include "BeckhoffAds.h"
+#include <asl/time.h>
+#include <stdlib.h>
+
+using namespace asl;
+
+int main(int argc, char* argv[])
+{
+	int    port = argc > 1 ? atoi(argv[1]) : 48898;
+	double latency = argc > 2 ? atof(argv[2]) : 0;
+	double jitter = argc > 3 ? atof(argv[3]) : 0;
+
+	AdsMockServer server;
+	server.setLatency(latency, jitter);
+
+	server.addVariable("plc1.count", "DINT", BeckhoffAds::ADST_INT32, 4);
+	server.addVariable("plc1.speed", "REAL", BeckhoffAds::ADST_REAL32, 4);
+	server.addVariable("plc1.factor", "REAL", BeckhoffAds::ADST_REAL32, 4);
+	server.addVariable("plc1.flag", "BOOL", BeckhoffAds::ADST_BIT, 1);
+	server.addVariable("plc1.inside", "BOOL", BeckhoffAds::ADST_BIT, 1);
+	server.addVariable("plc1.name", "STRING(80)", BeckhoffAds::ADST_STRING, 81, ByteArray((const byte*)"mock", 5));
+	server.addVariable("plc1.data", "ARRAY [0..999] OF REAL", BeckhoffAds::ADST_REAL32, 4000);
+
+	if (!server.start(port))
+		return 1;
+
+	printf("ADS mock server on port %i\n", port);
+
+	// a counter that changes continuously, to drive notifications
+
+	for (int i = 0;; i++)
+	{
+		sleep(0.01);
+		server.setValue<int>("plc1.count", i);
+	}
+	return 0;
+}